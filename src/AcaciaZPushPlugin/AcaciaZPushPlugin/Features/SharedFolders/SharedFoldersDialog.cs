@@ -413,8 +413,11 @@ namespace Acacia.Features.SharedFolders
                         // Restart
                         IRestarter restarter = ThisAddIn.Instance.Restarter();
                         restarter.CloseWindows = true;
+                        // Shares sync one month, or less if the account itself syncs less. Folder classes are 
+                        // not filtered per store; to share only a calendar, share that folder instead.
+                        SyncTimeFrame syncTimeFrame = _account.SyncTimeFrame.IsOneMonthOrLess() ? _account.SyncTimeFrame : SyncTimeFrame.MONTH_1;
                         foreach (StoreTreeNode node in state.stores)
-                            restarter.OpenShare(_account, node.User, node.ShowReminders);
+                            restarter.OpenShare(_account, node.User, node.ShowReminders, syncTimeFrame);
                         restarter.Restart();
                     }
 
@@ -25,7 +25,8 @@ namespace Acacia.Stubs
         /// </summary>
         /// <param name="account"></param>
         /// <param name="store"></param>
-        void OpenShare(ZPushAccount account, GABUser store, bool showReminders);
+        /// <param name="syncTimeFrame">The sync window of the new account</param>
+        void OpenShare(ZPushAccount account, GABUser store, bool showReminders, SyncTimeFrame syncTimeFrame);
 
         /// <summary>
         /// Performs the actual restart.
@@ -21,6 +21,7 @@ namespace Acacia.Stubs.OutlookWrappers
             public ZPushAccount account;
             public GABUser store;
             public bool showReminders;
+            public SyncTimeFrame syncTimeFrame;
         }
         private readonly List<Share> _shares = new List<Share>();
 
@@ -53,11 +54,11 @@ namespace Acacia.Stubs.OutlookWrappers
             _resyncAccounts.AddRange(accounts);
         }
 
-        public void OpenShare(ZPushAccount account, GABUser store, bool showReminders)
+        public void OpenShare(ZPushAccount account, GABUser store, bool showReminders, SyncTimeFrame syncTimeFrame)
         {
             _shares.Add(new Share()
             {
-                account = account, store = store, showReminders = showReminders
+                account = account, store = store, showReminders = showReminders, syncTimeFrame = syncTimeFrame
             });
         }
 
@@ -87,14 +88,16 @@ namespace Acacia.Stubs.OutlookWrappers
             {
                 foreach (Share share in _shares)
                 {
-                    Logger.Instance.Debug(this, "Adding KOE share: profile={0}, version={1}, accountid={2}, user={3}, email={4}, reminders={5}",
-                            _addIn.ProfileName, _addIn.VersionMajor, share.account.Account.AccountId, share.store.UserName, share.store.EmailAddress, share.showReminders);
-                    // TODO: escaping
-                    commandLine += " /sharekoe " + Util.QuoteCommandLine(_addIn.ProfileName + ":" + 
-                            _addIn.VersionMajor + ":" +
-                            share.account.Account.AccountId + ":" + 
-                            share.store.UserName + ":" + share.store.EmailAddress + ":" +
-                            share.store.EmailAddress + ":1:" + (share.showReminders ? "1" : "0"));
+                    Logger.Instance.Debug(this, "Adding KOE share: profile={0}, version={1}, accountid={2}, user={3}, email={4}, reminders={5}, sync={6}",
+                            _addIn.ProfileName, _addIn.VersionMajor, share.account.Account.AccountId, share.store.UserName, share.store.EmailAddress, share.showReminders,
+                            share.syncTimeFrame);
+                    // Escaped, as the names may contain colons
+                    commandLine += " /sharekoe " + Util.QuoteCommandLine(Util.JoinEscaped(':',
+                            _addIn.ProfileName,
+                            _addIn.VersionMajor,
+                            share.account.Account.AccountId,
+                            share.store.UserName, share.store.EmailAddress,
+                            share.store.EmailAddress, share.syncTimeFrame.ToEASAccountArgument(), share.showReminders ? "1" : "0"));
                 }
             }
 
@@ -172,6 +172,43 @@ namespace Acacia.Utils
             return "\"" + Regex.Replace(arg, @"(\\*)" + "\"", @"$1$1\" + "\"") + "\"";
         }
 
+        /// <summary>
+        /// Joins the parts with the separator, escaping separators and backslashes in the parts with
+        /// a backslash, so that SplitEscaped returns the original parts.
+        /// </summary>
+        public static string JoinEscaped(char separator, params string[] parts)
+        {
+            return string.Join(separator.ToString(), parts.Select(part =>
+                    (part ?? "").Replace("\\", "\\\\").Replace(separator.ToString(), "\\" + separator)));
+        }
+
+        /// <summary>
+        /// Splits a string created by JoinEscaped.
+        /// </summary>
+        public static string[] SplitEscaped(char separator, string s)
+        {
+            List<string> parts = new List<string>();
+            StringBuilder part = new StringBuilder();
+            for (int i = 0; i < s.Length; ++i)
+            {
+                if (s[i] == '\\' && i + 1 < s.Length)
+                {
+                    part.Append(s[++i]);
+                }
+                else if (s[i] == separator)
+                {
+                    parts.Add(part.ToString());
+                    part.Clear();
+                }
+                else
+                {
+                    part.Append(s[i]);
+                }
+            }
+            parts.Add(part.ToString());
+            return parts.ToArray();
+        }
+
         #endregion
 
         public static int Align(int size, int align)
@@ -182,6 +182,25 @@ namespace Acacia.ZPush
             return (int)_this < (int)other;
         }
 
+        /// <summary>
+        /// Returns the sync window argument of EASAccount.
+        /// </summary>
+        public static string ToEASAccountArgument(this SyncTimeFrame _this)
+        {
+            switch (_this)
+            {
+                case SyncTimeFrame.DAY_1: return "1d";
+                case SyncTimeFrame.DAY_3: return "3d";
+                case SyncTimeFrame.WEEK_1: return "1w";
+                case SyncTimeFrame.WEEK_2: return "2w";
+                case SyncTimeFrame.MONTH_1: return "1m";
+                case SyncTimeFrame.MONTH_3: return "3m";
+                case SyncTimeFrame.MONTH_6: return "6m";
+                case SyncTimeFrame.YEAR_1: return "1y";
+                default: return "all";
+            }
+        }
+
         public static string ToDisplayString(this SyncTimeFrame _this)
         {
             string s = Properties.Resources.ResourceManager.GetString("SyncTimeFrame_" + _this.ToString());
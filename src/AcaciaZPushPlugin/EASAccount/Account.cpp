@@ -0,0 +1,2039 @@
+#include "Account.h"
+
+bool verbose = true;
+
+static thread_local LogHandler logHandler = nullptr;
+static thread_local void *logContext = nullptr;
+
+static void Log(bool isVerbose, const wchar_t *format, va_list args)
+{
+	// The handler and stderr are not part of the operation being logged
+	PAUSE_ALLOCATION_COUNT();
+	wchar_t buffer[8192] = L"EAS: ";
+	vswprintf_s(buffer + wcslen(buffer), ARRAYSIZE(buffer) - wcslen(buffer), format, args);
+	_RPTW0(_CRT_WARN, buffer);
+	if (logHandler)
+		logHandler(logContext, isVerbose, buffer);
+	else
+		fputws(buffer, stderr);
+}
+
+void LOG(const wchar_t *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	Log(false, format, args);
+	va_end(args);
+}
+
+void VERBOSE(const wchar_t *format, ...)
+{
+	if (!verbose)
+		return;
+	va_list args;
+	va_start(args, format);
+	Log(true, format, args);
+	va_end(args);
+}
+
+ScopedLogHandler::ScopedLogHandler(LogHandler handler, void *context)
+:
+previousHandler(logHandler),
+previousContext(logContext)
+{
+	logHandler = handler;
+	logContext = context;
+}
+
+ScopedLogHandler::~ScopedLogHandler()
+{
+	logHandler = previousHandler;
+	logContext = previousContext;
+}
+
+StepGraph::StepGraph(const StartedCallback &started, const FinishedCallback &finished)
+:
+started(started),
+finished(finished)
+{
+	// Without a cleanup group every step runs on the calling thread
+	InitializeThreadpoolEnvironment(&environment);
+	cleanupGroup = CreateThreadpoolCleanupGroup();
+	if (cleanupGroup)
+		SetThreadpoolCallbackCleanupGroup(&environment, cleanupGroup, nullptr);
+	else
+		VERBOSE(L"StepGraph: Cannot create cleanup group: %.8X\n", GetLastError());
+}
+
+StepGraph::~StepGraph()
+{
+	// The callbacks still run code of this module after finishing their step, which must be 
+	// done before the caller can unload it
+	if (cleanupGroup)
+	{
+		CloseThreadpoolCleanupGroupMembers(cleanupGroup, FALSE, nullptr);
+		CloseThreadpoolCleanupGroup(cleanupGroup);
+	}
+	DestroyThreadpoolEnvironment(&environment);
+}
+
+void StepGraph::Run()
+{
+	// The pooled steps log through the same handler as the caller
+	logHandler = ::logHandler;
+	logContext = ::logContext;
+
+	unique_lock<mutex> guard(lock);
+	StartPooled();
+	for (;;)
+	{
+		Step *next = nullptr;
+		for (size_t i = 0; i < count && !error && !next; ++i)
+		{
+			if (steps[i].onCallingThread && IsReady(steps[i]))
+				next = &steps[i];
+		}
+
+		if (next)
+		{
+			next->state = STEP_RUNNING;
+			started(next->name);
+
+			guard.unlock();
+			exception_ptr stepError;
+			try
+			{
+				next->run();
+			}
+			catch (...)
+			{
+				stepError = current_exception();
+			}
+			guard.lock();
+			Finish(*next, stepError);
+			continue;
+		}
+
+		if (running == 0)
+			break;
+		changed.wait(guard);
+	}
+
+	if (error)
+		rethrow_exception(error);
+	if (done != (StepSet)((1ull << count) - 1))
+		throw exception("Step dependencies cannot be met");
+}
+
+void StepGraph::StartPooled()
+{
+	for (size_t i = 0; i < count && !error; ++i)
+	{
+		Step &step = steps[i];
+		if (step.onCallingThread || !IsReady(step))
+			continue;
+
+		// The step cannot finish before the lock is released, so it is counted after queueing
+		step.state = STEP_RUNNING;
+		if (cleanupGroup && TrySubmitThreadpoolCallback(RunPooled, &step, &environment))
+		{
+			++running;
+			started(step.name);
+		}
+		else
+		{
+			// Run it on the calling thread instead
+			VERBOSE(L"StepGraph: %ls: Cannot queue: %.8X\n", step.name, GetLastError());
+			step.state = STEP_PENDING;
+			step.onCallingThread = true;
+		}
+	}
+}
+
+void StepGraph::Finish(Step &step, exception_ptr stepError)
+{
+	step.state = STEP_FINISHED;
+	if (!step.onCallingThread)
+		--running;
+	if (stepError)
+	{
+		if (!error)
+			error = stepError;
+	}
+	else
+	{
+		done |= (StepSet)1 << (&step - steps);
+	}
+	finished(step.name, !stepError);
+
+	// Start what has become ready, without waiting for the calling thread
+	StartPooled();
+	changed.notify_all();
+}
+
+VOID CALLBACK StepGraph::RunPooled(PTP_CALLBACK_INSTANCE instance, PVOID context)
+{
+	Step &step = *(Step*)context;
+	StepGraph &graph = *step.graph;
+
+	// Also covers the callbacks of the steps started from here
+	ScopedLogHandler scopedHandler(graph.logHandler, graph.logContext);
+	exception_ptr stepError;
+	try
+	{
+		step.run();
+	}
+	catch (...)
+	{
+		stepError = current_exception();
+	}
+
+	lock_guard<mutex> guard(graph.lock);
+	graph.Finish(step, stepError);
+}
+
+#ifdef _DEBUG
+mutex AllocationCounter::hookLock;
+_CRT_ALLOC_HOOK AllocationCounter::previousHook = nullptr;
+int AllocationCounter::users = 0;
+long AllocationCounter::overlaps = 0;
+volatile long AllocationCounter::count = 0;
+thread_local int AllocationCounter::paused = 0;
+#endif
+
+vector<RegistryValue> ReadRegistryValues(HKEY hKey)
+{
+	DWORD count = 0, maxNameLength = 0, maxDataSize = 0;
+	CHECK_L(RegQueryInfoKey(hKey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 
+		&count, &maxNameLength, &maxDataSize, nullptr, nullptr), "ReadRegistryValues");
+
+	vector<RegistryValue> values(count);
+	vector<wchar_t> name(maxNameLength + 1);
+	for (DWORD i = 0; i < count; ++i)
+	{
+		RegistryValue &value = values[i];
+		DWORD nameLength = (DWORD)name.size();
+		DWORD dataSize = maxDataSize;
+		value.data.resize(maxDataSize);
+		CHECK_L(RegEnumValue(hKey, i, &name[0], &nameLength, nullptr, &value.type, 
+			value.data.empty() ? nullptr : &value.data[0], &dataSize), "ReadRegistryValues");
+		value.name.assign(&name[0], nameLength);
+		value.data.resize(dataSize);
+	}
+	return values;
+}
+
+vector<DWORD> ReadAccountIdList(HKEY hKeyAccounts, const wchar_t *value)
+{
+	DWORD buffer[1024];
+	DWORD bufferSize = sizeof(buffer);
+	CHECK_L(RegQueryValueEx(hKeyAccounts, value, nullptr, nullptr, (LPBYTE)buffer, &bufferSize), "QueryAccountId");
+	return vector<DWORD>(buffer, buffer + bufferSize / sizeof(DWORD));
+}
+
+HKEY OpenAccountsKey(const wstring &outlookVersion, const wstring &profileName)
+{
+	wchar_t keyPath[MAX_PATH];
+	HKEY hKey = nullptr;
+
+	// Open the accounts key
+	swprintf_s(keyPath, ARRAYSIZE(keyPath), KEY_ACCOUNTS, outlookVersion.c_str(), profileName.c_str());
+	CHECK_L(RegOpenKey(HKEY_CURRENT_USER, keyPath, &hKey), "OpenAccountsKey");
+	return hKey;
+}
+
+static wstring RegistryValueString(const RegistryValue &value)
+{
+	wstring s((const wchar_t*)value.data.data(), value.data.size() / sizeof(wchar_t));
+	while (!s.empty() && s.back() == L'\0')
+		s.pop_back();
+	return s;
+}
+
+static DWORD RegistryValueDword(const RegistryValue &value)
+{
+	if (value.type != REG_DWORD || value.data.size() != sizeof(DWORD))
+		return 0;
+	return *(const DWORD*)&value.data[0];
+}
+
+// The values that are represented in AccountInfo
+static const wstring *ACCOUNT_INFO_VALUES[] = 
+{
+	&R_ACCOUNT_NAME, &R_DISPLAY_NAME, &R_EMAIL, &R_EMAIL_ORIGINAL, &R_SERVER_URL, &R_USERNAME,
+	&R_ONE_MONTH, &R_SYNC_TIMEFRAME, &R_SHOW_REMINDERS
+};
+
+static bool IsAccountInfoValue(const RegistryValue &value)
+{
+	return find_if(begin(ACCOUNT_INFO_VALUES), end(ACCOUNT_INFO_VALUES), 
+		[&](const wstring *name) { return value.name == *name; }) != end(ACCOUNT_INFO_VALUES);
+}
+
+static bool IsEASAccount(const vector<RegistryValue> &values)
+{
+	return find_if(values.begin(), values.end(), 
+		[](const RegistryValue &value) { return value.name == R_USERNAME; }) != values.end();
+}
+
+static AccountInfo ToAccountInfo(DWORD accountId, const vector<RegistryValue> &values)
+{
+	AccountInfo info;
+	info.accountId = accountId;
+	info.syncTimeFrame = SYNC_ALL;
+	info.showReminders = true;
+
+	bool oneMonth = false;
+	for (auto value = values.begin(); value != values.end(); ++value)
+	{
+		if (value->name == R_ACCOUNT_NAME) info.accountName = RegistryValueString(*value);
+		else if (value->name == R_DISPLAY_NAME) info.displayName = RegistryValueString(*value);
+		else if (value->name == R_SERVER_URL) info.server = RegistryValueString(*value);
+		else if (value->name == R_USERNAME) info.username = RegistryValueString(*value);
+		else if (value->name == R_EMAIL) info.email = RegistryValueString(*value);
+		else if (value->name == R_EMAIL_ORIGINAL) info.emailOriginal = RegistryValueString(*value);
+		else if (value->name == R_ONE_MONTH) oneMonth = RegistryValueDword(*value) == 1;
+		else if (value->name == R_SYNC_TIMEFRAME) info.syncTimeFrame = RegistryValueDword(*value);
+		else if (value->name == R_SHOW_REMINDERS) info.showReminders = RegistryValueDword(*value) != 0;
+	}
+
+	// As in the plugin, a one month limit in Outlook overrides any longer window
+	if (oneMonth && !IsOneMonthOrLess(info.syncTimeFrame))
+		info.syncTimeFrame = SYNC_MONTH_1;
+	return info;
+}
+
+vector<DWORD> EnumerateAccountIds(HKEY hKeyAccounts)
+{
+	vector<DWORD> accountIds;
+	wchar_t keyName[MAX_PATH];
+	for (DWORD index = 0; ; ++index)
+	{
+		DWORD keyNameLength = ARRAYSIZE(keyName);
+		LSTATUS status = RegEnumKeyEx(hKeyAccounts, index, keyName, &keyNameLength, nullptr, nullptr, nullptr, nullptr);
+		if (status == ERROR_NO_MORE_ITEMS)
+			break;
+		CHECK_L(status, "EnumAccounts");
+
+		// Account keys are named by their id in hex
+		wchar_t *end;
+		DWORD accountId = wcstoul(keyName, &end, 16);
+		if (keyNameLength == 8 && !*end)
+			accountIds.push_back(accountId);
+	}
+	return accountIds;
+}
+
+static vector<RegistryValue> ReadAccountValues(HKEY hKeyAccounts, DWORD accountId)
+{
+	wchar_t keyName[16];
+	swprintf_s(keyName, ARRAYSIZE(keyName), L"%.8X", accountId);
+
+	CRegKey keyAccount;
+	CHECK_L(keyAccount.Open(hKeyAccounts, keyName, KEY_READ), "OpenAccountKey");
+	return ReadRegistryValues(keyAccount);
+}
+
+vector<AccountInfo> EnumerateAccounts(const wstring &profileName, const wstring &outlookVersion)
+{
+	CRegKey keyAccounts;
+	keyAccounts.Attach(OpenAccountsKey(outlookVersion, profileName));
+
+	vector<AccountInfo> accounts;
+	vector<DWORD> accountIds = EnumerateAccountIds(keyAccounts);
+	for (auto accountId = accountIds.begin(); accountId != accountIds.end(); ++accountId)
+	{
+		vector<RegistryValue> values = ReadAccountValues(keyAccounts, *accountId);
+		if (IsEASAccount(values))
+			accounts.push_back(ToAccountInfo(*accountId, values));
+	}
+	return accounts;
+}
+
+AccountInfo LoadAccountInfo(const wstring &profileName, const wstring &outlookVersion, DWORD accountId)
+{
+	CRegKey keyAccounts;
+	keyAccounts.Attach(OpenAccountsKey(outlookVersion, profileName));
+
+	vector<RegistryValue> values = ReadAccountValues(keyAccounts, accountId);
+	if (!IsEASAccount(values))
+		throw exception("Not an EAS account");
+	return ToAccountInfo(accountId, values);
+}
+
+Account::Account()
+:
+accountId(0)
+{
+	memset(&service, 0, sizeof(service));
+	// Reserved up front, so that Create does not allocate for them
+	path.reserve(MAX_PATH);
+	dataFolder.reserve(MAX_PATH);
+	entryId.reserve(ENTRY_ID_CAPACITY);
+	// PatchMessageStore is the only optional step
+	skippedSteps.reserve(1);
+}
+
+Account::~Account()
+{
+	// Recycle the id if nothing was created with it
+	if (accountIdReserved && !serviceCreated)
+		idAllocator->Return(accountId);
+
+	if (lpServiceAdmin2) lpServiceAdmin2->Release();
+	if (lpServiceAdmin) lpServiceAdmin->Release();
+	if (lpProfAdmin) lpProfAdmin->Release();
+	if (lpAccountManager) lpAccountManager->Release();
+	if (hKeyAccounts) RegCloseKey(hKeyAccounts);
+	if (hKeyNewAccount) RegCloseKey(hKeyNewAccount);
+
+	// Also after a failure, so a caller that goes on to the next account starts clean
+	if (initializedMAPI)
+		MAPIUninitialize();
+}
+
+void Account::LOG_VERBOSE(const wchar_t *prefix) const
+{
+	if (!verbose)
+		return;
+
+	VERBOSE
+	(
+		L"%ls\n"
+		L"\tprofileName=%ls\n"
+		L"\toutlookVersion=%ls\n"
+		L"\taccountName=%ls\n"
+		L"\tdisplayName=%ls\n"
+		L"\temail=%ls\n"
+		L"\temailOriginal=%ls\n"
+		L"\tserver=%ls\n"
+		L"\tusername=%ls\n"
+		L"\tpassword=%u\n"
+		L"\tencryptedPassword=%u\n"
+		L"\tdataFolder=%ls\n"
+		L"\tsyncTimeFrame=%u\n"
+		L"\tpath=%ls\n"
+		L"\tservice=%ls\n"
+		L"\tentryId=%ls\n"
+		L"\taccountId=%.8X\n"
+		L"\toneMonth=%d\n"
+		L"\treminders=%d\n",
+		prefix,
+		profileName.c_str(),
+		outlookVersion.c_str(),
+		accountName.c_str(),
+		displayName.c_str(),
+		email.c_str(),
+		emailOriginal.c_str(),
+		server.c_str(),
+		username.c_str(),
+		password.empty() ? 0 : 1,
+		encryptedPassword.size(),
+		dataFolder.c_str(),
+		syncTimeFrame,
+		path.c_str(),
+		ToHex(&service, sizeof(service)).c_str(),
+		ToHex(entryId).c_str(),
+		accountId,
+		IsOneMonthOrLess(syncTimeFrame) ? 1 : 0,
+		showReminders ? 1 : 0
+	);
+}
+
+void Account::Create()
+{
+	progressStep = 0;
+	progressSteps = 13;
+	skippedSteps.clear();
+
+	RunStep(L"CheckInit", [this]() { CheckInit(); });
+	// Usually shared with other accounts, but set up here otherwise, so it is not counted below
+	if (!idAllocator)
+		idAllocator = make_shared<AccountIdAllocator>(outlookVersion, profileName);
+
+	// With the buffers reserved by the constructor, only encrypting the password allocates
+	COUNT_ALLOCATIONS(L"Create", encryptedPassword.empty() ? 1 : 0);
+
+	// Only the MAPI steps depend on each other in a chain; the registry, file and encryption
+	// work runs alongside them. MAPI objects stay on this thread, which initialised MAPI.
+	StepGraph graph([this](const wchar_t *step) { Progress(step); }, 
+		[this](const wchar_t *step, bool succeeded) { StepFinished(step, succeeded); });
+	auto reserveAccountId = graph.Add(L"ReserveAccountId", 0, false, [this]() { ReserveAccountId(); });
+	auto determinePath = graph.Add(L"DeterminePath", 0, false, [this]() { DeterminePath(); });
+	auto deleteOldStore = graph.Add(L"DeleteOldStore", determinePath, false, [this]() { DeleteOldStore(); });
+	auto openAccountsKey = graph.Add(L"OpenAccountsKey", 0, false, [this]() { OpenAccountsKey(); });
+	auto encryptPassword = graph.Add(L"EncryptPassword", 0, false, [this]() { EncryptPassword(); });
+
+	// Set up the account
+	auto openProfileAdmin = graph.Add(L"OpenProfileAdmin", 0, true, [this]()
+	{
+		CheckTime(L"OpenProfileAdmin");
+		OpenProfileAdmin();
+	});
+
+	// The last point to stop cleanly; from CreateMessageService up to CommitAccountKey the
+	// steps are always completed, so no message service is left without an account
+	auto checkDeadline = graph.Add(L"CheckDeadline", 
+		reserveAccountId | deleteOldStore | encryptPassword | openProfileAdmin, true, [this]()
+	{
+		CheckTime(L"CreateMessageService");
+	});
+	auto createMessageService = graph.Add(L"CreateMessageService", checkDeadline, true, [this]() { CreateMessageService(); });
+	auto getEntryId = graph.Add(L"GetEntryId", createMessageService, true, [this]() { GetEntryId(); });
+	auto createAccount = graph.Add(L"CreateAccount", getEntryId | openAccountsKey, true, [this]() { CreateAccount(); });
+	graph.Add(L"CommitAccountKey", createAccount, true, [this]() { CommitAccountKey(); });
+	graph.Run();
+
+	// Outlook also finalises the store when it first opens it, so this can be left out
+	if (!timeBudget || timeBudget->HasTimeFor(L"PatchMessageStore"))
+	{
+		RunStep(L"PatchMessageStore", [this]() { PatchMessageStore(); });
+	}
+	else
+	{
+		Skip(L"PatchMessageStore");
+	}
+}
+
+void Account::Remove(const wstring &accountId)
+{
+	progressStep = 0;
+	progressSteps = 3;
+
+	Progress(L"OpenAccountKey");
+	ReadServiceUid(accountId);
+	this->accountId = wcstoul(accountId.c_str(), nullptr, 16);
+
+	Progress(L"DeleteMessageService");
+	OpenProfileAdmin();
+	GetOfflineStorePath();
+	HRESULT hr = lpServiceAdmin2->DeleteMsgService(&service);
+	if (hr != MAPI_E_NOT_FOUND)
+		CHECK_H(hr, "DeleteMsgService");
+
+	Progress(L"DeleteAccountKey");
+	{
+		ProfileLock lock(outlookVersion, profileName);
+		RemoveAccountId(KEY_OLKMAIL);
+		RemoveAccountId(KEY_OLKADDRESSBOOK);
+		RemoveAccountId(KEY_OLKSTORE);
+		CHECK_L(RegDeleteKey(hKeyAccounts, accountId.c_str()), "DeleteAccountKey");
+	}
+
+	if (!path.empty())
+	{
+		DeleteFile(path.c_str());
+		VERBOSE(L"Remove: Deleted OST: %.8X\n", GetLastError());
+	}
+}
+
+void Account::Verify(const wstring &accountId, AccountHealth &health)
+{
+	health.accountId = wcstoul(accountId.c_str(), nullptr, 16);
+	memset(&service, 0, sizeof(service));
+	path.clear();
+
+	// Each value on its own, as one missing value says nothing about the others. Missing 
+	// values are reported as a missing service or store.
+	OpenAccountKey(accountId);
+	TryRegReadAccountKey(R_DISPLAY_NAME, health.displayName);
+	TryRegReadAccountKeyBinary(R_STORE_EID, health.storeEntryId);
+	RegCloseKey(hKeyNewAccount);
+	hKeyNewAccount = nullptr;
+	bool hasServiceUid = TryReadServiceUid(accountId);
+
+	if (hasServiceUid)
+	{
+		OpenProfileAdmin();
+		health.serviceExists = ServiceExists();
+	}
+
+	if (health.serviceExists)
+	{
+		GetOfflineStorePath();
+		health.path = path;
+		health.ostExists = !path.empty() && GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+	}
+}
+
+void Account::Update(const AccountUpdate &update)
+{
+	progressStep = 0;
+	progressSteps = 3;
+
+	Progress(L"LoadAccount");
+	LoadFromAccountId(update.accountId);
+	accountId = wcstoul(update.accountId.c_str(), nullptr, 16);
+	password.clear();
+	if (update.changes & UPDATE_DISPLAY_NAME)
+		displayName = update.displayName;
+	if (update.changes & UPDATE_SYNC_TIMEFRAME)
+		syncTimeFrame = update.syncTimeFrame;
+	if (update.changes & UPDATE_SHOW_REMINDERS)
+		showReminders = update.showReminders;
+	if (update.changes & UPDATE_PASSWORD)
+	{
+		password = update.password;
+		encryptedPassword = EncryptPassword(password, L"EAS Password");
+	}
+
+	// The service first, as that is the part that is most likely to fail
+	Progress(L"ConfigureMessageService");
+	if (update.changes & (UPDATE_DISPLAY_NAME | UPDATE_PASSWORD))
+	{
+		ReadServiceUid(update.accountId);
+		OpenProfileAdmin();
+		ConfigureMessageService(update.changes);
+	}
+
+	Progress(L"WriteAccountKey");
+	OpenAccountKey(update.accountId);
+	try
+	{
+		if (update.changes & UPDATE_DISPLAY_NAME)
+			WriteAccountKey(R_DISPLAY_NAME, displayName);
+
+		// As on creation, values are only present if they differ from the default
+		if (update.changes & UPDATE_SYNC_TIMEFRAME)
+		{
+			if (IsOneMonthOrLess(syncTimeFrame))
+				WriteAccountKey(R_ONE_MONTH, (DWORD)1);
+			else
+				DeleteAccountKeyValue(R_ONE_MONTH);
+
+			if (syncTimeFrame != SYNC_ALL)
+				WriteAccountKey(R_SYNC_TIMEFRAME, syncTimeFrame);
+			else
+				DeleteAccountKeyValue(R_SYNC_TIMEFRAME);
+		}
+
+		if (update.changes & UPDATE_SHOW_REMINDERS)
+		{
+			if (!showReminders)
+				WriteAccountKey(R_SHOW_REMINDERS, (DWORD)0);
+			else
+				DeleteAccountKeyValue(R_SHOW_REMINDERS);
+		}
+
+		if (update.changes & UPDATE_PASSWORD)
+			WriteAccountKey(R_PASSWORD, &encryptedPassword[0], encryptedPassword.size());
+	}
+	catch (...)
+	{
+		RegCloseKey(hKeyNewAccount);
+		hKeyNewAccount = nullptr;
+		throw;
+	}
+	RegCloseKey(hKeyNewAccount);
+	hKeyNewAccount = nullptr;
+}
+
+void Account::LoadFromAccountId(const wstring &accountId)
+{
+	OpenAccountKey(accountId);
+
+	try
+	{ 
+		accountName = RegReadAccountKey(R_ACCOUNT_NAME);
+		displayName = RegReadAccountKey(R_DISPLAY_NAME);
+		email = RegReadAccountKey(R_EMAIL);
+		server = RegReadAccountKey(R_SERVER_URL);
+		username = RegReadAccountKey(R_USERNAME);
+		encryptedPassword = RegReadAccountKeyBinary(R_PASSWORD);
+	}
+	// Clean up
+	catch (...)
+	{
+		if (hKeyNewAccount)
+		{
+			RegCloseKey(hKeyNewAccount);
+			hKeyNewAccount = nullptr;
+		}
+		throw;
+	}
+	if (hKeyNewAccount)
+	{
+		RegCloseKey(hKeyNewAccount);
+		hKeyNewAccount = nullptr;
+	}
+}
+
+void Account::Progress(const wchar_t *step)
+{
+	// Whatever the caller does is not part of the operation
+	PAUSE_ALLOCATION_COUNT();
+	VERBOSE(L"%ls: %d/%d\n", step, progressStep + 1, progressSteps);
+	if (progress)
+		progress(step, progressStep, progressSteps);
+	++progressStep;
+}
+
+void Account::StepFinished(const wchar_t *step, bool succeeded)
+{
+	PAUSE_ALLOCATION_COUNT();
+	if (stepFinished)
+		stepFinished(step, succeeded);
+}
+
+void Account::CheckTime(const wchar_t *step)
+{
+	if (timeBudget && !timeBudget->HasTimeFor(step))
+	{
+		LOG(L"%ls: Out of time, stopping\n", step);
+		throw CustomException(ERROR_TIMEOUT, "Deadline");
+	}
+}
+
+void Account::Skip(const wchar_t *step)
+{
+	LOG(L"%ls: Out of time, skipped\n", step);
+	skippedSteps.push_back(step);
+	++progressStep;
+}
+
+void Account::DeterminePath()
+{
+	// Determine the .ost path
+	if (dataFolder.empty())
+	{
+		wchar_t szPath[MAX_PATH];
+		CHECK_H(SHGetFolderPath(nullptr, CSIDL_LOCAL_APPDATA, nullptr, 0, szPath), "GetAppData");
+		if (wcscat_s(szPath, L"\\Microsoft\\Outlook\\"))
+			throw exception("Data folder path too long");
+		dataFolder.assign(szPath);
+		VERBOSE(L"DeterminePath: dataFolder=%ls\n", dataFolder.c_str());
+	}
+	// Somehow it only works if there's a number in between parentheses
+	wchar_t buffer[MAX_PATH];
+	if (_snwprintf_s(buffer, ARRAYSIZE(buffer), _TRUNCATE, L"%ls%ls - %ls(1).ost", 
+		dataFolder.c_str(), email.c_str(), profileName.c_str()) < 0)
+	{
+		throw exception("OST path too long");
+	}
+	path.assign(buffer);
+	VERBOSE(L"DeterminePath: path=%ls\n", path.c_str());
+}
+
+void Account::DeleteOldStore()
+{
+	// Delete any existing ost
+	VERBOSE(L"DeleteOldStore: Deleting existing OST\n");
+	DeleteFile(path.c_str());
+	VERBOSE(L"DeleteOldStore: Deleted existing OST: %.8X\n", GetLastError());
+}
+
+void Account::EncryptPassword()
+{
+	// TODO: handle the case password is not set in registry
+	if (encryptedPassword.empty())
+		encryptedPassword = EncryptPassword(password, L"EAS Password");
+}
+
+void Account::CheckInit()
+{
+	#define DoCheckInit(field) do{ if (field.empty()) throw exception("Field " #field " not initialised"); } while(0)
+	DoCheckInit(profileName);
+	DoCheckInit(outlookVersion);
+	DoCheckInit(accountName);
+	DoCheckInit(displayName);
+	DoCheckInit(email);
+	DoCheckInit(server);
+	DoCheckInit(username);
+	if (encryptedPassword.empty())
+		DoCheckInit(password);
+	#undef DoCheckInit
+}
+
+void Account::InitializeMAPI()
+{
+	// Only loaded once there is MAPI work to do
+	if (!initializedMAPI)
+	{
+		MAPIINIT_0	MAPIINIT = { 0, 0 };
+		CHECK_H(MAPIInitialize(&MAPIINIT), "MAPIInitialize");
+		initializedMAPI = true;
+	}
+}
+
+void Account::OpenProfileAdmin()
+{
+	if (!lpServiceAdmin2)
+	{
+		InitializeMAPI();
+		VERBOSE(L"OpenProfileAdmin: 1\n");
+		// Get the profile admin 
+		CHECK_H(MAPIAdminProfiles(0, &lpProfAdmin), "MAPIAdminProfiles");
+		CHECK_H(lpProfAdmin->AdminServices((LPTSTR)WideToString(profileName).c_str(), nullptr, NULL, 0, &lpServiceAdmin), "AdminServices");
+		CHECK_H(lpServiceAdmin->QueryInterface(IID_IMsgServiceAdmin2, (LPVOID*)&lpServiceAdmin2), "AdminServices2");
+		VERBOSE(L"OpenProfileAdmin: 2\n");
+	}
+}
+
+void Account::CreateMessageService()
+{
+	VERBOSE(L"CreateMessageService: 1\n");
+	CHECK_H(lpServiceAdmin2->CreateMsgServiceEx((LPTSTR)"EAS", (LPTSTR)displayName.c_str(), 0, 0, &service), "CreateMsgServiceEx");
+	serviceCreated = true;
+
+	// Configure the service
+	SPropValue msprops[6];
+	msprops[0].ulPropTag = PR_PST_CONFIG_FLAGS;
+	msprops[0].Value.l = 2;
+
+	msprops[1].ulPropTag = PR_PROFILE_OFFLINE_STORE_PATH_W;
+	msprops[1].Value.lpszW = (LPWSTR)path.c_str();
+
+	msprops[2].ulPropTag = PR_DISPLAY_NAME_W;
+	msprops[2].Value.lpszW = (LPWSTR)displayName.c_str();
+
+	msprops[3].ulPropTag = PR_PROFILE_SECURE_MAILBOX;
+	msprops[3].Value.bin.cb = (ULONG)encryptedPassword.size();
+	msprops[3].Value.bin.lpb = &encryptedPassword[0];
+
+	msprops[4].ulPropTag = PR_RESOURCE_FLAGS;
+	msprops[4].Value.l = SERVICE_NO_PRIMARY_IDENTITY | SERVICE_CREATE_WITH_STORE | SERVICE_SINGLE_COPY;
+
+	msprops[5].ulPropTag = 0x67060003;
+	msprops[5].Value.l = accountId;
+
+	VERBOSE(L"CreateMessageService: 2\n");
+	CHECK_H(lpServiceAdmin2->ConfigureMsgService(&service, 0, SERVICE_UI_ALLOWED, 6, msprops), "ConfigureMSGService");
+	VERBOSE(L"CreateMessageService: 3\n");
+}
+
+void Account::ConfigureMessageService(DWORD changes)
+{
+	SPropValue msprops[2];
+	ULONG count = 0;
+	if (changes & UPDATE_DISPLAY_NAME)
+	{
+		msprops[count].ulPropTag = PR_DISPLAY_NAME_W;
+		msprops[count].Value.lpszW = (LPWSTR)displayName.c_str();
+		++count;
+	}
+	if (changes & UPDATE_PASSWORD)
+	{
+		msprops[count].ulPropTag = PR_PROFILE_SECURE_MAILBOX;
+		msprops[count].Value.bin.cb = (ULONG)encryptedPassword.size();
+		msprops[count].Value.bin.lpb = &encryptedPassword[0];
+		++count;
+	}
+	CHECK_H(lpServiceAdmin2->ConfigureMsgService(&service, 0, 0, count, msprops), "ConfigureMSGService");
+}
+
+void Account::GetEntryId()
+{
+	IProfSect *profSect = nullptr;
+	LPSPropValue vals = nullptr;
+	try
+	{
+	VERBOSE(L"GetEntryId: 1\n");
+		// Open the profile section
+		CHECK_H(lpServiceAdmin2->OpenProfileSection(const_cast<LPMAPIUID>(&service), NULL, MAPI_FORCE_ACCESS, &profSect), "ProfSect");
+
+	VERBOSE(L"GetEntryId: 2\n");
+		// Get the entry id
+		SizedSPropTagArray(1, props);
+		props.cValues = 1;
+		props.aulPropTag[0] = PR_ENTRYID;
+
+		ULONG count = 0;
+		CHECK_H(profSect->GetProps((LPSPropTagArray)&props, 0, &count, &vals), "GetProps");
+	VERBOSE(L"GetEntryId: 3\n");
+
+		entryId.assign(vals[0].Value.bin.lpb, vals[0].Value.bin.lpb + vals[0].Value.bin.cb);
+
+		// Clean up
+		profSect->Release();
+		MAPIFreeBuffer(vals);
+	VERBOSE(L"GetEntryId: 4, size=%d, value=%s\n", entryId.size(), ToHex(entryId).c_str());
+	}
+	catch (...)
+	{
+		if (profSect) profSect->Release();
+		MAPIFreeBuffer(vals);
+		throw;
+	}
+}
+
+bool Account::ServiceExists()
+{
+	LPMAPITABLE table = nullptr;
+	LPSRowSet rows = nullptr;
+	bool found = false;
+	try
+	{
+		CHECK_H(lpServiceAdmin2->GetMsgServiceTable(0, &table), "GetMsgServiceTable");
+
+		SizedSPropTagArray(1, props);
+		props.cValues = 1;
+		props.aulPropTag[0] = PR_SERVICE_UID;
+		CHECK_H(table->SetColumns((LPSPropTagArray)&props, 0), "SetColumns");
+
+		for (;;)
+		{
+			CHECK_H(table->QueryRows(64, 0, &rows), "QueryRows");
+			ULONG count = rows->cRows;
+			for (ULONG i = 0; i < count && !found; ++i)
+			{
+				const SPropValue &uid = rows->aRow[i].lpProps[0];
+				found = uid.ulPropTag == PR_SERVICE_UID && uid.Value.bin.cb == sizeof(service) && 
+					!memcmp(uid.Value.bin.lpb, &service, sizeof(service));
+			}
+			FreeProws(rows);
+			rows = nullptr;
+			if (found || count == 0)
+				break;
+		}
+
+		table->Release();
+	}
+	catch (...)
+	{
+		if (rows) FreeProws(rows);
+		if (table) table->Release();
+		throw;
+	}
+	return found;
+}
+
+void Account::GetOfflineStorePath()
+{
+	IProfSect *profSect = nullptr;
+	LPSPropValue vals = nullptr;
+	try
+	{
+		// Open the profile section
+		CHECK_H(lpServiceAdmin2->OpenProfileSection(const_cast<LPMAPIUID>(&service), NULL, MAPI_FORCE_ACCESS, &profSect), "ProfSect");
+
+		SizedSPropTagArray(1, props);
+		props.cValues = 1;
+		props.aulPropTag[0] = PR_PROFILE_OFFLINE_STORE_PATH_W;
+
+		// A missing property is returned as an error value, which is fine
+		ULONG count = 0;
+		CHECK_H(profSect->GetProps((LPSPropTagArray)&props, 0, &count, &vals), "GetProps");
+		if (vals[0].ulPropTag == PR_PROFILE_OFFLINE_STORE_PATH_W)
+			path.assign(vals[0].Value.lpszW);
+		else
+			path.clear();
+
+		// Clean up
+		profSect->Release();
+		MAPIFreeBuffer(vals);
+	VERBOSE(L"GetOfflineStorePath: %ls\n", path.c_str());
+	}
+	catch (...)
+	{
+		if (profSect) profSect->Release();
+		MAPIFreeBuffer(vals);
+		throw;
+	}
+}
+
+void Account::OpenAccountsKey()
+{
+	if (hKeyAccounts != nullptr)
+		return;
+
+	hKeyAccounts = ::OpenAccountsKey(outlookVersion, profileName);
+}
+
+void Account::OpenAccountKey(const wstring &accountId)
+{
+	OpenAccountsKey();
+
+	// Open the subkey
+	CHECK_L(RegOpenKey(hKeyAccounts, accountId.c_str(), &hKeyNewAccount), "OpenAccountKey");
+}
+
+void Account::ReserveAccountId()
+{
+	// Reserve the id before any other work, so concurrent instances cannot pick the same one
+	if (!idAllocator)
+		idAllocator = make_shared<AccountIdAllocator>(outlookVersion, profileName);
+	accountId = idAllocator->Take();
+	accountIdReserved = true;
+}
+
+void Account::AllocateAccountKey()
+{
+	OpenAccountsKey();
+
+	wchar_t keyPath[MAX_PATH];
+
+	// Create the subkey
+	swprintf_s(keyPath, ARRAYSIZE(keyPath), L"%.8X", accountId);
+	CHECK_L(RegCreateKey(hKeyAccounts, keyPath, &hKeyNewAccount), "CreateAccountKey");
+}
+
+void Account::ReadServiceUid(const wstring &accountId)
+{
+	OpenAccountKey(accountId);
+	try
+	{
+		vector<byte> serviceUid = RegReadAccountKeyBinary(R_SERVICE_UID);
+		if (serviceUid.size() != sizeof(service))
+			throw exception("Invalid Service UID");
+		memcpy(&service, &serviceUid[0], sizeof(service));
+	}
+	catch (...)
+	{
+		RegCloseKey(hKeyNewAccount);
+		hKeyNewAccount = nullptr;
+		throw;
+	}
+	RegCloseKey(hKeyNewAccount);
+	hKeyNewAccount = nullptr;
+}
+
+bool Account::TryReadServiceUid(const wstring &accountId)
+{
+	try
+	{
+		ReadServiceUid(accountId);
+		return true;
+	}
+	catch (const exception &)
+	{
+		return false;
+	}
+}
+
+wstring Account::RegReadAccountKey(const wstring &name)
+{
+	wchar_t buffer[4096];
+	DWORD size = sizeof(buffer);
+	CHECK_L(RegQueryValueEx(hKeyNewAccount, name.c_str(), nullptr, nullptr, (LPBYTE)buffer, &size), "RegReadAccountKey");
+	return buffer;
+}
+
+vector<byte> Account::RegReadAccountKeyBinary(const wstring &name)
+{
+	byte buffer[4096];
+	DWORD size = sizeof(buffer);
+	CHECK_L(RegQueryValueEx(hKeyNewAccount, name.c_str(), nullptr, nullptr, buffer, &size), "RegReadAccountKey");
+	return vector<byte>(buffer, buffer + size);
+}
+
+bool Account::TryRegReadAccountKey(const wstring &name, wstring &value)
+{
+	try
+	{
+		value = RegReadAccountKey(name);
+		return true;
+	}
+	catch (const CustomException &)
+	{
+		return false;
+	}
+}
+
+bool Account::TryRegReadAccountKeyBinary(const wstring &name, vector<byte> &value)
+{
+	try
+	{
+		value = RegReadAccountKeyBinary(name);
+		return true;
+	}
+	catch (const CustomException &)
+	{
+		return false;
+	}
+}
+
+void Account::WriteAccountKey(const wstring &name, const wstring &value)
+{
+	CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_SZ, (LPBYTE)value.data(), (DWORD)value.size() * 2), "WriteAccountKey");
+}
+
+void Account::WriteAccountKey(const wstring &name, const wchar_t *value)
+{
+	CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_SZ, (LPBYTE)value, (DWORD)wcslen(value) * 2), "WriteAccountKey");
+}
+
+void Account::WriteAccountKey(const wstring &name, const void *value, size_t size)
+{
+	CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_BINARY, (LPBYTE)value, (DWORD)size), "WriteAccountKey");
+}
+
+void Account::WriteAccountKey(const wstring &name, DWORD value)
+{
+	CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_DWORD, (LPBYTE)&value, sizeof(value)), "WriteAccountKey");
+}
+
+void Account::DeleteAccountKeyValue(const wstring &name)
+{
+	LSTATUS status = RegDeleteValue(hKeyNewAccount, name.c_str());
+	if (status != ERROR_FILE_NOT_FOUND)
+		CHECK_L(status, "DeleteAccountKeyValue");
+}
+
+class Account::OlkHelper : public IOlkAccountHelper
+{
+private:
+	long refCount;
+	const Account &account;
+	IUnknown* unkSession;
+public:
+	OlkHelper(const Account &account, LPMAPISESSION session)
+	:
+	refCount(0),
+	account(account),
+	unkSession(nullptr)
+	{
+		CHECK_H(session->QueryInterface(IID_IUnknown, (LPVOID*)&unkSession), "Session::QueryInterface");
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject) override
+	{
+		return S_OK;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef(void) override
+	{
+		++refCount;
+		return refCount;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE Release(void) override
+	{
+		--refCount;
+		return refCount;
+	}
+
+	virtual STDMETHODIMP PlaceHolder1(LPVOID) override
+	{
+		return S_OK;
+	}
+
+	virtual STDMETHODIMP GetIdentity(LPWSTR pwszIdentity, DWORD * pcch) override
+	{
+		if (!pcch)
+			return E_INVALIDARG;
+
+		HRESULT hRes = S_OK;
+
+		if (account.profileName.size() > *pcch)
+		{
+			*pcch = (DWORD)account.profileName.size();
+			return E_OUTOFMEMORY;
+		}
+
+		hRes = StringCchCopyW(pwszIdentity, *pcch, account.profileName.c_str());
+
+		*pcch = (DWORD)account.profileName.size();
+
+		return hRes;
+	}
+
+	virtual STDMETHODIMP GetMapiSession(LPUNKNOWN * ppmsess) override
+	{
+	VERBOSE(L"GetMapiSession: 1\n");
+		CHECK_H(unkSession->QueryInterface(IID_IMAPISession, (LPVOID*)ppmsess), "GetMapiSession");
+		return S_OK;
+	}
+
+	virtual STDMETHODIMP HandsOffSession() override
+	{
+		return S_OK;
+	}
+
+};
+
+void Account::CreateAccount()
+{
+	VERBOSE(L"CreateAccount\n");
+	AllocateAccountKey();
+
+	// Write the values
+	VERBOSE(L"CreateAccount: Setting registry keys\n");
+	WriteAccountKey(R_ACCOUNT_NAME, accountName);
+	WriteAccountKey(R_DISPLAY_NAME, displayName);
+	WriteAccountKey(R_SERVER_URL, server);
+	WriteAccountKey(R_USERNAME, username);
+	WriteAccountKey(R_EMAIL, email);
+
+	if (!emailOriginal.empty())
+		WriteAccountKey(R_EMAIL_ORIGINAL, emailOriginal);
+
+	// Outlook limits the window to one month, KOE narrows it down further
+	if (IsOneMonthOrLess(syncTimeFrame))
+		WriteAccountKey(R_ONE_MONTH, (DWORD)1);
+
+	if (syncTimeFrame != SYNC_ALL)
+		WriteAccountKey(R_SYNC_TIMEFRAME, syncTimeFrame);
+
+	if (!showReminders)
+		WriteAccountKey(R_SHOW_REMINDERS, (DWORD)0);
+
+	WriteAccountKey(R_CLSID, CLSID_EAS_ACCOUNT);
+
+	WriteAccountKey(R_PASSWORD, &encryptedPassword[0], encryptedPassword.size());
+
+	WriteAccountKey(R_SERVICE_UID, &service, sizeof(service));
+
+	// Delivery Store EntryID
+	WriteAccountKey(R_STORE_EID, &entryId[0], entryId.size());
+
+	// Mini uid
+	GUID miniUid;
+	CHECK_H(CoCreateGuid(&miniUid), "miniUid");
+	WriteAccountKey(R_MINI_UID, miniUid.Data1);
+
+	for (auto i = extraValues.begin(); i != extraValues.end(); ++i)
+	{
+		CHECK_L(RegSetValueEx(hKeyNewAccount, i->name.c_str(), 0, i->type, 
+			i->data.empty() ? nullptr : &i->data[0], (DWORD)i->data.size()), "WriteAccountKey");
+	}
+}
+
+void Account::AppendAccountId(const wchar_t *value)
+{
+	byte buffer[4096];
+	DWORD bufferSize = sizeof(buffer);
+	CHECK_L(RegQueryValueEx(hKeyAccounts, value, nullptr, nullptr, buffer, &bufferSize), "QueryAccountId");
+
+	if (bufferSize >= sizeof(buffer) - sizeof(DWORD))
+		throw exception("AppendAccountId buffer too small");
+
+	// Append the account id
+	*(DWORD *)(&buffer[bufferSize]) = accountId;
+	CHECK_L(RegSetValueEx(hKeyAccounts, value, 0, REG_BINARY, buffer, bufferSize + sizeof(DWORD)), "AppendAccountId");
+}
+
+void Account::RemoveAccountId(const wchar_t *value)
+{
+	DWORD buffer[1024];
+	DWORD bufferSize = sizeof(buffer);
+	CHECK_L(RegQueryValueEx(hKeyAccounts, value, nullptr, nullptr, (LPBYTE)buffer, &bufferSize), "QueryAccountId");
+
+	DWORD *end = remove(buffer, buffer + bufferSize / sizeof(DWORD), accountId);
+	CHECK_L(RegSetValueEx(hKeyAccounts, value, 0, REG_BINARY, (LPBYTE)buffer, (DWORD)((end - buffer) * sizeof(DWORD))), "RemoveAccountId");
+}
+
+void Account::CommitAccountKey()
+{
+	// NextAccountID was already moved past our id when it was reserved
+	VERBOSE(L"CommitAccountKey: %d\n", accountId);
+
+	// Add the account to the mail, store and addressbook entries. These are read-modify-write,
+	// so must be done under the profile lock.
+	ProfileLock lock(outlookVersion, profileName);
+	if (accountLists & ACCOUNT_LIST_MAIL)
+		AppendAccountId(KEY_OLKMAIL);
+	if (accountLists & ACCOUNT_LIST_ADDRESSBOOK)
+		AppendAccountId(KEY_OLKADDRESSBOOK);
+	if (accountLists & ACCOUNT_LIST_STORE)
+		AppendAccountId(KEY_OLKSTORE);
+}
+
+std::vector<byte> Account::EncryptPassword(const std::wstring &password, const wchar_t *descriptor)
+{
+	const byte FLAG_PROTECT_DATA = 2;
+
+	DATA_BLOB plainTextBlob;
+	DATA_BLOB cipherTextBlob;
+
+	int bytesSize = (int)(password.size() * sizeof(wchar_t));
+	plainTextBlob.pbData = (BYTE*)password.data();
+	plainTextBlob.cbData = bytesSize + 2;
+
+	if (!CryptProtectData(&plainTextBlob, descriptor, nullptr, nullptr, nullptr,
+		CRYPTPROTECT_UI_FORBIDDEN, &cipherTextBlob))
+	{
+		throw std::exception("Encryption failed.");
+	}
+
+	std::vector<byte> cipherText(cipherTextBlob.cbData + 1);
+	memcpy(&cipherText[1], cipherTextBlob.pbData, cipherTextBlob.cbData);
+	cipherText[0] = FLAG_PROTECT_DATA;
+	LocalFree(cipherTextBlob.pbData);
+	return cipherText;
+}
+
+void Account::PatchMessageStore()
+{
+	LPMAPISESSION session = nullptr;
+	LPMDB msgStore = nullptr;
+	IOlkAccount *account = nullptr;
+
+	try
+	{
+	VERBOSE(L"PatchMessageStore: Deleting existing OST 1\n");
+		// Delete existing store
+		DeleteFile(path.c_str());
+	VERBOSE(L"PatchMessageStore: Deleted existing OST 1: %.8X\n", GetLastError());
+
+		// Logon
+		InitializeMAPI();
+		CHECK_H(MAPILogonEx(0, (LPTSTR)WideToString(profileName).c_str(), NULL, 0, &session), "MAPILogonEx");
+
+#if 0
+		OlkHelper helper(*this, session);
+		CHECK_H(CoCreateInstance(CLSID_OlkAccountManager,
+			NULL,
+			CLSCTX_INPROC_SERVER,
+			IID_IOlkAccountManager,
+			(LPVOID*)&lpAccountManager), "IOLKAccountManager");
+		CHECK_H(lpAccountManager->Init(&helper, 0), "IOLKAccountManager::Init");
+		DWORD count;
+		DWORD *order;
+		CHECK_H(lpAccountManager->GetOrder(&CLSID_OlkMail, &count, &order), "IOLKAccountManager::GetOrder");
+		_RPT1(_CRT_WARN, "ACCOUNTS: %d\n", count);
+
+		// Create the registry entry for the account
+		//CHECK_H(lpAccountManager->EnumerateAccounts(CLSID_OlkMail, ))
+		ACCT_VARIANT var;
+		var.dwType = PT_LONG;
+		var.Val.dw = accountId;
+		CHECK_H(lpAccountManager->FindAccount(PROP_ACCT_ID, &var, &account), "IOLKAccountManager::FindAccount");
+		CHECK_H(lpAccountManager->SaveChanges(accountId, 0), "SaveChanges");
+#endif
+
+		// Delete existing store
+	VERBOSE(L"PatchMessageStore: Deleting existing OST 2\n");
+		DeleteFile(path.c_str());
+	VERBOSE(L"PatchMessageStore: Deleted existing OST 2: %.8X\n", GetLastError());
+
+		if (entryId.size() == 0)
+			throw exception("entryId not initialised");
+
+	VERBOSE(L"PatchMessageStore: OpenMsgStore\n");
+		// Open the msg store to finalise creation
+		CHECK_H(session->OpenMsgStore(0, (ULONG)entryId.size(), (LPENTRYID)&entryId[0], nullptr,
+			MDB_NO_DIALOG | MDB_WRITE | MAPI_DEFERRED_ERRORS, &msgStore), "OpenMsgStore");
+	}
+	catch (...)
+	{
+		if (account)
+			account->Release();
+		if (msgStore) 
+			msgStore->Release();
+		if (session)
+		{
+			session->Logoff(0, 0, 0);
+			session->Release();
+		}
+		throw;
+	}
+
+	// Clean up
+	if (account)
+		account->Release();
+	if (msgStore) 
+		msgStore->Release();
+	session->Logoff(0, 0, 0);
+	session->Release();
+}
+static wstring Format(const wchar_t *format, ...)
+{
+	wchar_t buffer[1024];
+	va_list args;
+	va_start(args, format);
+	_vsnwprintf_s(buffer, ARRAYSIZE(buffer), _TRUNCATE, format, args);
+	va_end(args);
+	return buffer;
+}
+
+bool Account::Plan(vector<wstring> &changes, DWORD &existingAccountId)
+{
+	CheckInit();
+	if (find_if(begin(SYNC_TIMEFRAMES), end(SYNC_TIMEFRAMES), 
+		[&](decltype(SYNC_TIMEFRAMES[0]) &t) { return t.timeFrame == syncTimeFrame; }) == end(SYNC_TIMEFRAMES))
+	{
+		throw exception("Invalid sync window");
+	}
+
+	// Also fails if the profile does not exist
+	vector<AccountInfo> accounts = EnumerateAccounts(profileName, outlookVersion);
+	for (auto account = accounts.begin(); account != accounts.end(); ++account)
+	{
+		if (!_wcsicmp(account->server.c_str(), server.c_str()) && !_wcsicmp(account->username.c_str(), username.c_str()))
+		{
+			existingAccountId = account->accountId;
+			VERBOSE(L"Plan: Same as account %.8X\n", existingAccountId);
+			return false;
+		}
+		// The OST path is derived from the email address, so the stores would collide
+		if (!_wcsicmp(account->email.c_str(), email.c_str()))
+		{
+			LOG(L"Email address %ls is already used by account %.8X\n", email.c_str(), account->accountId);
+			throw exception("Email address already in use");
+		}
+	}
+
+	DeterminePath();
+
+	OpenAccountsKey();
+	DWORD nextAccountId = 0;
+	DWORD size = sizeof(nextAccountId);
+	CHECK_L(RegQueryValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, nullptr, nullptr, (LPBYTE)&nextAccountId, &size), "GetNextAccountId");
+
+	// In the order Create performs them; values only known then are described
+	changes.push_back(Format(L"Reserve an account id, from NextAccountID %.8X", nextAccountId));
+	changes.push_back(Format(L"Delete OST %ls%ls", path.c_str(), 
+		GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES ? L" (exists)" : L" (does not exist)"));
+	changes.push_back(Format(L"Create message service EAS \"%ls\"", displayName.c_str()));
+	changes.push_back(Format(L"Configure message service: PR_PST_CONFIG_FLAGS=2, PR_PROFILE_OFFLINE_STORE_PATH=%ls, "
+		L"PR_DISPLAY_NAME=%ls, PR_PROFILE_SECURE_MAILBOX=<encrypted password>, "
+		L"PR_RESOURCE_FLAGS=%.8X, 0x67060003=<account id>", 
+		path.c_str(), displayName.c_str(), SERVICE_NO_PRIMARY_IDENTITY | SERVICE_CREATE_WITH_STORE | SERVICE_SINGLE_COPY));
+	changes.push_back(L"Create account key <account id>");
+
+	changes.push_back(Format(L"Write %ls=%ls", R_ACCOUNT_NAME.c_str(), accountName.c_str()));
+	changes.push_back(Format(L"Write %ls=%ls", R_DISPLAY_NAME.c_str(), displayName.c_str()));
+	changes.push_back(Format(L"Write %ls=%ls", R_SERVER_URL.c_str(), server.c_str()));
+	changes.push_back(Format(L"Write %ls=%ls", R_USERNAME.c_str(), username.c_str()));
+	changes.push_back(Format(L"Write %ls=%ls", R_EMAIL.c_str(), email.c_str()));
+	if (!emailOriginal.empty())
+		changes.push_back(Format(L"Write %ls=%ls", R_EMAIL_ORIGINAL.c_str(), emailOriginal.c_str()));
+	if (IsOneMonthOrLess(syncTimeFrame))
+		changes.push_back(Format(L"Write %ls=1", R_ONE_MONTH.c_str()));
+	if (syncTimeFrame != SYNC_ALL)
+		changes.push_back(Format(L"Write %ls=%u", R_SYNC_TIMEFRAME.c_str(), syncTimeFrame));
+	if (!showReminders)
+		changes.push_back(Format(L"Write %ls=0", R_SHOW_REMINDERS.c_str()));
+	changes.push_back(Format(L"Write %ls=%ls", R_CLSID.c_str(), CLSID_EAS_ACCOUNT));
+	changes.push_back(Format(L"Write %ls=<encrypted password>", R_PASSWORD.c_str()));
+	changes.push_back(Format(L"Write %ls=<message service uid>", R_SERVICE_UID.c_str()));
+	changes.push_back(Format(L"Write %ls=<store entry id>", R_STORE_EID.c_str()));
+	changes.push_back(Format(L"Write %ls=<new random value>", R_MINI_UID.c_str()));
+	for (auto value = extraValues.begin(); value != extraValues.end(); ++value)
+	{
+		changes.push_back(Format(L"Write %ls (type %u, %u bytes)", 
+			value->name.c_str(), value->type, (unsigned)value->data.size()));
+	}
+
+	changes.push_back(Format(L"Add account id to lists:%ls%ls%ls", 
+		(accountLists & ACCOUNT_LIST_MAIL) ? L" mail" : L"", 
+		(accountLists & ACCOUNT_LIST_ADDRESSBOOK) ? L" addressbook" : L"", 
+		(accountLists & ACCOUNT_LIST_STORE) ? L" store" : L""));
+
+	// PatchMessageStore, unless the time budget leaves it out
+	changes.push_back(Format(L"Delete OST %ls", path.c_str()));
+	changes.push_back(Format(L"Delete OST %ls", path.c_str()));
+	changes.push_back(L"Open the store to finalise it");
+	return true;
+}
+
+// Opening a store logs on to the profile and opens the OST, which is slow enough to be worth
+// spreading over a few sessions.
+static const size_t VERIFY_THREADS = 4;
+
+// Opens the stores of the accounts, taking them from the shared index, in its own session
+static void VerifyStores(FixedString<char, MAX_PATH> profileName, vector<AccountHealth*> &accounts, atomic<size_t> &next)
+{
+	MAPIINIT_0 MAPIINIT = { 0, 0 };
+	HRESULT hrInit = MAPIInitialize(&MAPIINIT);
+	HRESULT hr = hrInit;
+	LPMAPISESSION session = nullptr;
+	if (SUCCEEDED(hr))
+		hr = MAPILogonEx(0, (LPTSTR)profileName.c_str(), nullptr, MAPI_NEW_SESSION | MAPI_NO_MAIL | MAPI_EXTENDED, &session);
+	if (FAILED(hr))
+		LOG(L"VerifyAccounts: Logon failed: %.8X\n", hr);
+
+	for (size_t i; (i = next++) < accounts.size(); )
+	{
+		AccountHealth &health = *accounts[i];
+		if (FAILED(hr))
+		{
+			health.storeResult = hr;
+			continue;
+		}
+
+		// Read only, so nothing is changed if the store is broken
+		LPMDB store = nullptr;
+		health.storeResult = session->OpenMsgStore(0, (ULONG)health.storeEntryId.size(), (LPENTRYID)&health.storeEntryId[0], 
+			nullptr, MDB_NO_DIALOG | MDB_NO_MAIL, &store);
+		if (store)
+			store->Release();
+		VERBOSE(L"VerifyAccounts: %.8X: OpenMsgStore: %.8X\n", health.accountId, health.storeResult);
+	}
+
+	if (session)
+	{
+		session->Logoff(0, 0, 0);
+		session->Release();
+	}
+	if (SUCCEEDED(hrInit))
+		MAPIUninitialize();
+}
+
+vector<AccountHealth> VerifyAccounts(const wstring &profileName, const wstring &outlookVersion)
+{
+	CRegKey keyAccounts;
+	keyAccounts.Attach(OpenAccountsKey(outlookVersion, profileName));
+
+	// The registry and service checks are cheap and share a single profile admin
+	Account account;
+	account.profileName = profileName;
+	account.outlookVersion = outlookVersion;
+
+	vector<DWORD> lists[3] = 
+	{ 
+		ReadAccountIdList(keyAccounts, KEY_OLKMAIL), 
+		ReadAccountIdList(keyAccounts, KEY_OLKADDRESSBOOK), 
+		ReadAccountIdList(keyAccounts, KEY_OLKSTORE) 
+	};
+
+	vector<AccountHealth> accounts;
+	vector<DWORD> accountIds = EnumerateAccountIds(keyAccounts);
+	for (auto accountId = accountIds.begin(); accountId != accountIds.end(); ++accountId)
+	{
+		if (!IsEASAccount(ReadAccountValues(keyAccounts, *accountId)))
+			continue;
+
+		accounts.push_back(AccountHealth());
+		AccountHealth &health = accounts.back();
+		for (int i = 0; i < 3; ++i)
+		{
+			if (find(lists[i].begin(), lists[i].end(), *accountId) != lists[i].end())
+				health.accountLists |= 1 << i;
+		}
+
+		// A broken account is what this looks for, so it must not stop the others
+		wchar_t keyName[16];
+		swprintf_s(keyName, ARRAYSIZE(keyName), L"%.8X", *accountId);
+		try
+		{
+			account.Verify(keyName, health);
+		}
+		catch (const CustomException &e)
+		{
+			wchar_t buffer[128];
+			swprintf_s(buffer, ARRAYSIZE(buffer), L"%hs: %.8X", e.what(), e.status);
+			health.error = buffer;
+		}
+		catch (const exception &e)
+		{
+			wchar_t buffer[128];
+			swprintf_s(buffer, ARRAYSIZE(buffer), L"%hs", e.what());
+			health.error = buffer;
+		}
+		if (!health.error.empty())
+		{
+			health.accountId = *accountId;
+			LOG(L"VerifyAccounts: %.8X: %ls\n", *accountId, health.error.c_str());
+		}
+	}
+
+	// Only open stores that exist; opening a missing OST would create it
+	vector<AccountHealth*> stores;
+	for (auto health = accounts.begin(); health != accounts.end(); ++health)
+	{
+		if (health->error.empty() && health->serviceExists && health->ostExists && !health->storeEntryId.empty())
+			stores.push_back(&*health);
+	}
+
+	if (!stores.empty())
+	{
+		// The threads log through the same handler as the caller
+		FixedString<char, MAX_PATH> profileNameA = WideToString(profileName);
+		LogHandler handler = logHandler;
+		void *context = logContext;
+		atomic<size_t> next(0);
+
+		vector<thread> threads;
+		for (size_t i = 0; i < min(VERIFY_THREADS, stores.size()); ++i)
+		{
+			threads.push_back(thread([&]()
+			{
+				ScopedLogHandler scopedHandler(handler, context);
+				VerifyStores(profileNameA, stores, next);
+			}));
+		}
+		for (auto thread = threads.begin(); thread != threads.end(); ++thread)
+			thread->join();
+	}
+
+	return accounts;
+}
+
+// Snapshot format, with DWORD numbers, counted UTF-16 strings and sized binary data:
+//   magic[8] version flags [salt[16] iterations check] count { accountId lists valueCount { name type data } }
+// With a passphrase, passwords are stored AES-GCM encrypted instead of as DPAPI blobs, which only
+// the exporting user can decrypt. The check is an encrypted empty string.
+static const char SNAPSHOT_MAGIC[8] = { 'K', 'O', 'E', 'S', 'N', 'A', 'P', '\0' };
+static const DWORD SNAPSHOT_VERSION = 2;
+static const DWORD SNAPSHOT_FLAG_PASSPHRASE = 1;
+static const DWORD SNAPSHOT_SALT_SIZE = 16;
+// PBKDF2 iterations for new snapshots, and the most that is accepted on import
+static const DWORD SNAPSHOT_ITERATIONS = 600000;
+static const DWORD SNAPSHOT_MAX_ITERATIONS = 10000000;
+
+// Values that refer to the old service, store or device and are regenerated on import
+static const wstring *SNAPSHOT_SKIP_VALUES[] = 
+{
+	&R_CLSID, &R_SERVICE_UID, &R_STORE_EID, &R_MINI_UID, 
+	&R_DELIVERY_STORE_EID, &R_DELIVERY_FOLDER_EID, &R_DEVICE_ID
+};
+
+struct SnapshotAccount
+{
+	DWORD accountId;
+	DWORD accountLists;
+	vector<RegistryValue> values;
+};
+
+class SnapshotBuffer
+{
+private:
+	vector<byte> data;
+	size_t position = 0;
+
+public:
+	void Write(const void *value, size_t size)
+	{
+		data.insert(data.end(), (const byte*)value, (const byte*)value + size);
+	}
+
+	void Write(DWORD value)
+	{
+		Write(&value, sizeof(value));
+	}
+
+	void Write(const wstring &value)
+	{
+		Write((DWORD)value.size());
+		Write(value.data(), value.size() * sizeof(wchar_t));
+	}
+
+	void Write(const vector<byte> &value)
+	{
+		Write((DWORD)value.size());
+		if (!value.empty())
+			Write(&value[0], value.size());
+	}
+
+	void Read(void *value, size_t size)
+	{
+		if (size > data.size() - position)
+			throw exception("Snapshot truncated");
+		memcpy(value, &data[position], size);
+		position += size;
+	}
+
+	DWORD ReadDword()
+	{
+		DWORD value;
+		Read(&value, sizeof(value));
+		return value;
+	}
+
+	// Reads a count of items that each take at least itemSize bytes, so a corrupt count is 
+	// caught before anything is allocated for it
+	DWORD ReadCount(size_t itemSize)
+	{
+		DWORD count = ReadDword();
+		if (count > (data.size() - position) / itemSize)
+			throw exception("Snapshot truncated");
+		return count;
+	}
+
+	wstring ReadString()
+	{
+		DWORD length = ReadDword();
+		if (length > (data.size() - position) / sizeof(wchar_t))
+			throw exception("Snapshot truncated");
+		wstring value(length, L'\0');
+		Read(&value[0], length * sizeof(wchar_t));
+		return value;
+	}
+
+	vector<byte> ReadBytes()
+	{
+		DWORD size = ReadDword();
+		if (size > data.size() - position)
+			throw exception("Snapshot truncated");
+		vector<byte> value(data.begin() + position, data.begin() + position + size);
+		position += size;
+		return value;
+	}
+
+	void Save(const wstring &path) const
+	{
+		CAtlFile file;
+		CHECK_H(file.Create(path.c_str(), GENERIC_WRITE, 0, CREATE_ALWAYS), "SaveSnapshot");
+		CHECK_H(file.Write(data.empty() ? nullptr : &data[0], (DWORD)data.size()), "SaveSnapshot");
+	}
+
+	void Load(const wstring &path)
+	{
+		CAtlFile file;
+		ULONGLONG size;
+		CHECK_H(file.Create(path.c_str(), GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING), "LoadSnapshot");
+		CHECK_H(file.GetSize(size), "LoadSnapshot");
+		if (size > 0x10000000)
+			throw exception("Snapshot too large");
+		data.resize((size_t)size);
+		position = 0;
+		if (!data.empty())
+			CHECK_H(file.Read(&data[0], (DWORD)data.size()), "LoadSnapshot");
+	}
+};
+
+// From ntstatus.h, which cannot be included together with the Windows headers
+#ifndef STATUS_AUTH_TAG_MISMATCH
+#define STATUS_AUTH_TAG_MISMATCH ((NTSTATUS)0xC000A002L)
+#endif
+
+// AES-GCM key derived from the snapshot passphrase with PBKDF2
+class SnapshotCipher
+{
+private:
+	static const ULONG KEY_SIZE = 32;
+	static const ULONG NONCE_SIZE = 12;
+	static const ULONG TAG_SIZE = 16;
+	BCRYPT_ALG_HANDLE hAlg = nullptr;
+	BCRYPT_KEY_HANDLE hKey = nullptr;
+
+public:
+	SnapshotCipher(const wstring &passphrase, const byte *salt, DWORD iterations)
+	{
+		BCRYPT_ALG_HANDLE hPrf = nullptr;
+		byte key[KEY_SIZE];
+		try
+		{
+			CHECK_NT(BCryptOpenAlgorithmProvider(&hPrf, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG), "BCryptOpenAlgorithmProvider");
+			CHECK_NT(BCryptDeriveKeyPBKDF2(hPrf, (PUCHAR)passphrase.data(), (ULONG)(passphrase.size() * sizeof(wchar_t)), 
+				(PUCHAR)salt, SNAPSHOT_SALT_SIZE, iterations, key, sizeof(key), 0), "BCryptDeriveKeyPBKDF2");
+			BCryptCloseAlgorithmProvider(hPrf, 0);
+			hPrf = nullptr;
+
+			CHECK_NT(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_AES_ALGORITHM, nullptr, 0), "BCryptOpenAlgorithmProvider");
+			CHECK_NT(BCryptSetProperty(hAlg, BCRYPT_CHAINING_MODE, (PUCHAR)BCRYPT_CHAIN_MODE_GCM, sizeof(BCRYPT_CHAIN_MODE_GCM), 0), "BCryptSetProperty");
+			CHECK_NT(BCryptGenerateSymmetricKey(hAlg, &hKey, nullptr, 0, key, sizeof(key), 0), "BCryptGenerateSymmetricKey");
+			SecureZeroMemory(key, sizeof(key));
+		}
+		catch (...)
+		{
+			SecureZeroMemory(key, sizeof(key));
+			if (hPrf) BCryptCloseAlgorithmProvider(hPrf, 0);
+			if (hAlg) BCryptCloseAlgorithmProvider(hAlg, 0);
+			throw;
+		}
+	}
+
+	static void GenerateRandom(byte *data, ULONG size)
+	{
+		CHECK_NT(BCryptGenRandom(nullptr, data, size, BCRYPT_USE_SYSTEM_PREFERRED_RNG), "BCryptGenRandom");
+	}
+
+	~SnapshotCipher()
+	{
+		BCryptDestroyKey(hKey);
+		BCryptCloseAlgorithmProvider(hAlg, 0);
+	}
+
+	SnapshotCipher(const SnapshotCipher&) = delete;
+	SnapshotCipher &operator=(const SnapshotCipher&) = delete;
+
+	// Returns the nonce, the tag and the encrypted password, in that order
+	vector<byte> Encrypt(const wstring &password)
+	{
+		ULONG size = (ULONG)(password.size() * sizeof(wchar_t));
+		vector<byte> data(NONCE_SIZE + TAG_SIZE + size);
+		GenerateRandom(data.data(), NONCE_SIZE);
+
+		BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+		BCRYPT_INIT_AUTH_MODE_INFO(info);
+		info.pbNonce = data.data();
+		info.cbNonce = NONCE_SIZE;
+		info.pbTag = data.data() + NONCE_SIZE;
+		info.cbTag = TAG_SIZE;
+
+		ULONG written = 0;
+		CHECK_NT(BCryptEncrypt(hKey, (PUCHAR)password.data(), size, &info, nullptr, 0, 
+			data.data() + NONCE_SIZE + TAG_SIZE, size, &written, 0), "BCryptEncrypt");
+		return data;
+	}
+
+	wstring Decrypt(const vector<byte> &data)
+	{
+		if (data.size() < NONCE_SIZE + TAG_SIZE || (data.size() - NONCE_SIZE - TAG_SIZE) % sizeof(wchar_t))
+			throw exception("Invalid encrypted password");
+		ULONG size = (ULONG)(data.size() - NONCE_SIZE - TAG_SIZE);
+
+		BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+		BCRYPT_INIT_AUTH_MODE_INFO(info);
+		info.pbNonce = (PUCHAR)data.data();
+		info.cbNonce = NONCE_SIZE;
+		info.pbTag = (PUCHAR)data.data() + NONCE_SIZE;
+		info.cbTag = TAG_SIZE;
+
+		vector<byte> plainText(size);
+		ULONG written = 0;
+		NTSTATUS status = BCryptDecrypt(hKey, (PUCHAR)data.data() + NONCE_SIZE + TAG_SIZE, size, &info, nullptr, 0, 
+			plainText.data(), size, &written, 0);
+		if (status == STATUS_AUTH_TAG_MISMATCH)
+			throw exception("Unable to decrypt password, wrong passphrase?");
+		CHECK_NT(status, "BCryptDecrypt");
+
+		wstring password((const wchar_t*)plainText.data(), written / sizeof(wchar_t));
+		if (!plainText.empty())
+			SecureZeroMemory(plainText.data(), plainText.size());
+		return password;
+	}
+};
+
+static bool DecryptPassword(const vector<byte> &encrypted, wstring &password)
+{
+	const byte FLAG_PROTECT_DATA = 2;
+	if (encrypted.size() < 2 || encrypted[0] != FLAG_PROTECT_DATA)
+		return false;
+
+	DATA_BLOB cipherTextBlob;
+	DATA_BLOB plainTextBlob;
+	cipherTextBlob.pbData = (BYTE*)&encrypted[1];
+	cipherTextBlob.cbData = (DWORD)encrypted.size() - 1;
+	if (!CryptUnprotectData(&cipherTextBlob, nullptr, nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &plainTextBlob))
+		return false;
+
+	password.assign((const wchar_t*)plainTextBlob.pbData, plainTextBlob.cbData / sizeof(wchar_t));
+	// Strip the terminator included by EncryptPassword
+	while (!password.empty() && password.back() == L'\0')
+		password.pop_back();
+
+	SecureZeroMemory(plainTextBlob.pbData, plainTextBlob.cbData);
+	LocalFree(plainTextBlob.pbData);
+	return true;
+}
+
+void ExportAccounts(const wstring &profileName, const wstring &outlookVersion, const wstring &path, const wstring &passphrase)
+{
+	CRegKey keyAccounts;
+	keyAccounts.Attach(OpenAccountsKey(outlookVersion, profileName));
+
+	byte salt[SNAPSHOT_SALT_SIZE] = {};
+	unique_ptr<SnapshotCipher> cipher;
+	if (!passphrase.empty())
+	{
+		SnapshotCipher::GenerateRandom(salt, sizeof(salt));
+		cipher.reset(new SnapshotCipher(passphrase, salt, SNAPSHOT_ITERATIONS));
+	}
+
+	vector<SnapshotAccount> accounts;
+	{
+		// Hold the lock to get a consistent view of the accounts and the id lists
+		ProfileLock lock(outlookVersion, profileName);
+		vector<DWORD> lists[3] = 
+		{ 
+			ReadAccountIdList(keyAccounts, KEY_OLKMAIL), 
+			ReadAccountIdList(keyAccounts, KEY_OLKADDRESSBOOK), 
+			ReadAccountIdList(keyAccounts, KEY_OLKSTORE) 
+		};
+
+		vector<DWORD> accountIds = EnumerateAccountIds(keyAccounts);
+		for (auto accountId = accountIds.begin(); accountId != accountIds.end(); ++accountId)
+		{
+			SnapshotAccount account;
+			account.accountId = *accountId;
+			account.values = ReadAccountValues(keyAccounts, *accountId);
+
+			// Only EAS accounts
+			if (!IsEASAccount(account.values))
+				continue;
+
+			account.accountLists = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				if (find(lists[i].begin(), lists[i].end(), account.accountId) != lists[i].end())
+					account.accountLists |= 1 << i;
+			}
+			accounts.push_back(account);
+		}
+	}
+
+	SnapshotBuffer snapshot;
+	snapshot.Write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	snapshot.Write(SNAPSHOT_VERSION);
+	snapshot.Write(cipher ? SNAPSHOT_FLAG_PASSPHRASE : 0);
+	if (cipher)
+	{
+		snapshot.Write(salt, sizeof(salt));
+		snapshot.Write(SNAPSHOT_ITERATIONS);
+		snapshot.Write(cipher->Encrypt(L""));
+	}
+	snapshot.Write((DWORD)accounts.size());
+	for (auto account = accounts.begin(); account != accounts.end(); ++account)
+	{
+		snapshot.Write(account->accountId);
+		snapshot.Write(account->accountLists);
+		snapshot.Write((DWORD)account->values.size());
+		for (auto value = account->values.begin(); value != account->values.end(); ++value)
+		{
+			if (cipher && value->name == R_PASSWORD)
+			{
+				wstring password;
+				if (!DecryptPassword(value->data, password))
+					throw CustomException(GetLastError(), "DecryptPassword");
+				value->data = cipher->Encrypt(password);
+				SecureZeroMemory(&password[0], password.size() * sizeof(wchar_t));
+			}
+			snapshot.Write(value->name);
+			snapshot.Write(value->type);
+			snapshot.Write(value->data);
+		}
+		VERBOSE(L"ExportAccounts: %.8X: %u values\n", account->accountId, account->values.size());
+	}
+	snapshot.Save(path);
+	LOG(L"Exported %u accounts to %ls\n", accounts.size(), path.c_str());
+}
+
+int ImportAccounts(const wstring &profileName, const wstring &outlookVersion, const wstring &path, const wstring &passphrase)
+{
+	SnapshotBuffer snapshot;
+	snapshot.Load(path);
+
+	char magic[sizeof(SNAPSHOT_MAGIC)];
+	snapshot.Read(magic, sizeof(magic));
+	if (memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)))
+		throw exception("Not a snapshot file");
+	if (snapshot.ReadDword() != SNAPSHOT_VERSION)
+		throw exception("Unsupported snapshot version");
+
+	unique_ptr<SnapshotCipher> cipher;
+	if (snapshot.ReadDword() & SNAPSHOT_FLAG_PASSPHRASE)
+	{
+		if (passphrase.empty())
+			throw exception("Snapshot requires a passphrase");
+		byte salt[SNAPSHOT_SALT_SIZE];
+		snapshot.Read(salt, sizeof(salt));
+		DWORD iterations = snapshot.ReadDword();
+		if (iterations == 0 || iterations > SNAPSHOT_MAX_ITERATIONS)
+			throw exception("Invalid snapshot");
+		cipher.reset(new SnapshotCipher(passphrase, salt, iterations));
+		cipher->Decrypt(snapshot.ReadBytes());
+	}
+
+	// The id, lists and value count of an account, and the name, type and data sizes of a value
+	const size_t MIN_ACCOUNT_SIZE = 3 * sizeof(DWORD);
+	const size_t MIN_VALUE_SIZE = 3 * sizeof(DWORD);
+	vector<SnapshotAccount> accounts(snapshot.ReadCount(MIN_ACCOUNT_SIZE));
+	for (auto account = accounts.begin(); account != accounts.end(); ++account)
+	{
+		account->accountId = snapshot.ReadDword();
+		account->accountLists = snapshot.ReadDword();
+		account->values.resize(snapshot.ReadCount(MIN_VALUE_SIZE));
+		for (auto value = account->values.begin(); value != account->values.end(); ++value)
+		{
+			value->name = snapshot.ReadString();
+			value->type = snapshot.ReadDword();
+			value->data = snapshot.ReadBytes();
+		}
+	}
+
+	// Reserve all the ids at once
+	auto idAllocator = make_shared<AccountIdAllocator>(outlookVersion, profileName);
+	idAllocator->Reserve((DWORD)accounts.size());
+
+	int failed = 0;
+	for (auto snapshotAccount = accounts.begin(); snapshotAccount != accounts.end(); ++snapshotAccount)
+	{
+		AccountInfo info = ToAccountInfo(snapshotAccount->accountId, snapshotAccount->values);
+		Account account;
+		account.profileName = profileName;
+		account.outlookVersion = outlookVersion;
+		account.accountName = info.accountName;
+		account.displayName = info.displayName;
+		account.email = info.email;
+		account.emailOriginal = info.emailOriginal;
+		account.server = info.server;
+		account.username = info.username;
+		account.syncTimeFrame = info.syncTimeFrame;
+		account.showReminders = info.showReminders;
+		account.accountLists = snapshotAccount->accountLists;
+		account.idAllocator = idAllocator;
+
+		try
+		{
+			for (auto value = snapshotAccount->values.begin(); value != snapshotAccount->values.end(); ++value)
+			{
+				if (IsAccountInfoValue(*value))
+				{
+					continue;
+				}
+				else if (value->name == R_PASSWORD)
+				{
+					if (cipher)
+					{
+						// Encrypted again for the current user on creation
+						account.password = cipher->Decrypt(value->data);
+					}
+					else
+					{
+						// Only usable as is if it can be decrypted by the current user
+						wstring password;
+						if (!DecryptPassword(value->data, password))
+							throw exception("Password cannot be decrypted by this user, export with a passphrase");
+						SecureZeroMemory(&password[0], password.size() * sizeof(wchar_t));
+						account.encryptedPassword = value->data;
+					}
+				}
+				else
+				{
+					auto skip = find_if(begin(SNAPSHOT_SKIP_VALUES), end(SNAPSHOT_SKIP_VALUES), 
+						[&](const wstring *name) { return value->name == *name; });
+					if (skip == end(SNAPSHOT_SKIP_VALUES))
+						account.extraValues.push_back(*value);
+				}
+			}
+
+			vector<wstring> changes;
+			DWORD existingAccountId = 0;
+			if (!account.Plan(changes, existingAccountId))
+			{
+				LOG(L"Skipped account %.8X: already exists as %.8X\n", snapshotAccount->accountId, existingAccountId);
+			}
+			else
+			{
+				account.LOG_VERBOSE(L"Importing account");
+				account.Create();
+				LOG(L"Imported account %.8X: %ls\n", snapshotAccount->accountId, account.displayName.c_str());
+			}
+		}
+		catch (const CustomException &e)
+		{
+			LOG(L"Failed to import account %.8X: %s\n", snapshotAccount->accountId, e.message.c_str());
+			++failed;
+		}
+		catch (const exception &e)
+		{
+			LOG(L"Failed to import account %.8X: %hs\n", snapshotAccount->accountId, e.what());
+			++failed;
+		}
+		SecureZeroMemory(&account.password[0], account.password.size() * sizeof(wchar_t));
+	}
+	return failed;
+}
+
+int UpdateAccounts(const wstring &profileName, const wstring &outlookVersion, const vector<AccountUpdate> &updates)
+{
+	// A single account, so the profile admin is opened once for all updates
+	Account account;
+	account.profileName = profileName;
+	account.outlookVersion = outlookVersion;
+
+	int failed = 0;
+	for (auto update = updates.begin(); update != updates.end(); ++update)
+	{
+		try
+		{
+			account.Update(*update);
+			LOG(L"Updated account %ls: %ls\n", update->accountId.c_str(), account.displayName.c_str());
+		}
+		catch (const CustomException &e)
+		{
+			LOG(L"Failed to update account %ls: %s\n", update->accountId.c_str(), e.message.c_str());
+			++failed;
+		}
+		catch (const exception &e)
+		{
+			LOG(L"Failed to update account %ls: %hs\n", update->accountId.c_str(), e.what());
+			++failed;
+		}
+		SecureZeroMemory(&account.password[0], account.password.size() * sizeof(wchar_t));
+	}
+	return failed;
+}
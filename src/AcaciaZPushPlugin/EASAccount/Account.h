@@ -0,0 +1,752 @@
+#ifndef __EASACCOUNT_ACCOUNT_H__
+#define __EASACCOUNT_ACCOUNT_H__
+
+#include "EASAccount.h"
+
+extern bool verbose;
+
+void LOG(const wchar_t *format, ...);
+void VERBOSE(const wchar_t *format, ...);
+
+// Receives the formatted log messages. Without a handler they are written to stderr.
+typedef void (*LogHandler)(void *context, bool isVerbose, const wchar_t *message);
+
+// Installs a log handler for the current thread while in scope
+class ScopedLogHandler
+{
+private:
+	LogHandler previousHandler;
+	void *previousContext;
+
+public:
+	ScopedLogHandler(LogHandler handler, void *context);
+	~ScopedLogHandler();
+
+	ScopedLogHandler(const ScopedLogHandler&) = delete;
+	ScopedLogHandler &operator=(const ScopedLogHandler&) = delete;
+};
+
+// String in a fixed-size buffer, to avoid heap allocations for short-lived strings
+template<class Char, size_t Size>
+struct FixedString
+{
+	Char buffer[Size];
+
+	const Char *c_str() const
+	{
+		return buffer;
+	}
+};
+
+// Long enough for any entry id; longer data is truncated
+typedef FixedString<wchar_t, 513> HexString;
+
+inline static HexString ToHex(const void *data, size_t size)
+{
+	static const wchar_t DIGITS[] = L"0123456789ABCDEF";
+	HexString s;
+	wchar_t *out = s.buffer;
+	size = min(size, (ARRAYSIZE(s.buffer) - 1) / 2);
+	for (const byte *ptr = (byte*)data; ptr < ((byte*)data) + size; ++ptr)
+	{
+		*out++ = DIGITS[*ptr >> 4];
+		*out++ = DIGITS[*ptr & 0xF];
+	}
+	*out = L'\0';
+	return s;
+}
+
+template<class Type> 
+inline static HexString ToHex(const vector<Type> &v)
+{
+	return ToHex(v.data(), v.size() * sizeof(Type));
+}
+
+// MAPI takes the profile name as an ANSI string
+inline static FixedString<char, MAX_PATH> WideToString(const wstring &s)
+{
+	FixedString<char, MAX_PATH> result;
+	if (s.size() >= ARRAYSIZE(result.buffer))
+		throw exception("String too long");
+	for (size_t i = 0; i < s.size(); ++i)
+		result.buffer[i] = (char)s[i];
+	result.buffer[s.size()] = '\0';
+	return result;
+}
+
+
+#ifdef _DEBUG
+// Counts the CRT heap allocations of this module during an operation and asserts that they
+// stay within the budget. MAPI has its own heap and is not included, and neither is logging.
+class AllocationCounter
+{
+private:
+	static mutex hookLock;
+	static _CRT_ALLOC_HOOK previousHook;
+	static int users;
+	// Bumped whenever a counter starts while another exists
+	static long overlaps;
+	static volatile long count;
+	static thread_local int paused;
+
+	const wchar_t *operation;
+	long budget;
+	long start;
+	bool startedAlone;
+	long startOverlaps;
+	int startExceptions;
+
+	static int __cdecl Hook(int allocType, void *userData, size_t size, int blockType, long requestNumber, 
+		const unsigned char *filename, int lineNumber)
+	{
+		if (allocType != _HOOK_FREE && blockType != _CRT_BLOCK && !paused)
+			InterlockedIncrement(&count);
+		if (previousHook)
+			return previousHook(allocType, userData, size, blockType, requestNumber, filename, lineNumber);
+		return TRUE;
+	}
+
+public:
+	// Leaves the allocations of the current thread out of the count while in scope
+	class Pause
+	{
+	public:
+		Pause() { ++paused; }
+		~Pause() { --paused; }
+	};
+
+	AllocationCounter(const wchar_t *operation, long budget)
+	:
+	operation(operation),
+	budget(budget),
+	startExceptions(uncaught_exceptions())
+	{
+		lock_guard<mutex> guard(hookLock);
+		if (users == 0)
+			previousHook = _CrtSetAllocHook(Hook);
+		else
+			++overlaps;
+		startedAlone = users == 0;
+		startOverlaps = overlaps;
+		++users;
+		start = count;
+	}
+
+	~AllocationCounter()
+	{
+		long allocations = count - start;
+		bool alone;
+		{
+			lock_guard<mutex> guard(hookLock);
+			alone = startedAlone && overlaps == startOverlaps;
+			if (--users == 0)
+				_CrtSetAllocHook(previousHook);
+		}
+
+		VERBOSE(L"%ls: %ld allocations\n", operation, allocations);
+		// A failure allocates for the exception
+		if (alone && uncaught_exceptions() == startExceptions)
+		{
+			if (allocations > budget)
+				LOG(L"%ls: %ld allocations exceeds budget of %ld\n", operation, allocations, budget);
+			_ASSERTE(allocations <= budget);
+		}
+	}
+
+	AllocationCounter(const AllocationCounter&) = delete;
+	AllocationCounter &operator=(const AllocationCounter&) = delete;
+};
+
+#define COUNT_ALLOCATIONS(operation, budget) AllocationCounter allocationCounter(operation, budget)
+#define PAUSE_ALLOCATION_COUNT() AllocationCounter::Pause allocationCountPause
+#else
+#define COUNT_ALLOCATIONS(operation, budget) do {} while (0)
+#define PAUSE_ALLOCATION_COUNT() do {} while (0)
+#endif
+
+inline void CHECK_H(HRESULT hr, const char *ident)
+{
+	if (FAILED(hr))
+		throw CustomException(hr, ident, _com_error(hr).ErrorMessage());
+}
+
+inline void CHECK_L(LSTATUS status, const char *ident)
+{
+	if (status != ERROR_SUCCESS)
+		throw CustomException(status, ident);
+}
+
+inline void CHECK_B(BOOL success, const char *ident)
+{
+	if (!success)
+		throw CustomException(GetLastError(), ident);
+}
+
+inline void CHECK_NT(NTSTATUS status, const char *ident)
+{
+	if (!BCRYPT_SUCCESS(status))
+		throw CustomException(status, ident, CustomException::KIND_NTSTATUS);
+}
+
+static const wstring R_ACCOUNT_NAME = L"Account Name";
+static const wstring R_DISPLAY_NAME = L"Display Name";
+static const wstring R_SERVER_URL = L"EAS Server URL";
+static const wstring R_USERNAME = L"EAS User";
+static const wstring R_EMAIL = L"Email";
+static const wstring R_EMAIL_ORIGINAL = L"KOE Share For";
+static const wstring R_PASSWORD = L"EAS Password";
+static const wstring R_ONE_MONTH = L"EAS SyncSlider";
+static const wstring R_SHOW_REMINDERS = L"KOE Reminders";
+static const wstring R_SYNC_TIMEFRAME = L"KOE SyncTimeFrame";
+static const wstring R_CLSID = L"clsid";
+static const wstring R_SERVICE_UID = L"Service UID";
+static const wstring R_STORE_EID = L"EAS Store EID";
+static const wstring R_MINI_UID = L"Mini UID";
+static const wstring R_DELIVERY_STORE_EID = L"Delivery Store EntryID";
+static const wstring R_DELIVERY_FOLDER_EID = L"Delivery Folder EntryID";
+static const wstring R_DEVICE_ID = L"EAS DeviceId";
+
+static const wchar_t *CLSID_EAS_ACCOUNT = L"{ED475415-B0D6-11D2-8C3B-00104B2A6676}";
+
+// The account id lists an account is registered in
+static const DWORD ACCOUNT_LIST_MAIL = 1;
+static const DWORD ACCOUNT_LIST_ADDRESSBOOK = 2;
+static const DWORD ACCOUNT_LIST_STORE = 4;
+static const DWORD ACCOUNT_LIST_ALL = ACCOUNT_LIST_MAIL | ACCOUNT_LIST_ADDRESSBOOK | ACCOUNT_LIST_STORE;
+
+// Sync windows, matching SyncTimeFrame in the plugin
+static const DWORD SYNC_ALL = 0;
+static const DWORD SYNC_DAY_1 = 1;
+static const DWORD SYNC_DAY_3 = 2;
+static const DWORD SYNC_WEEK_1 = 3;
+static const DWORD SYNC_WEEK_2 = 4;
+static const DWORD SYNC_MONTH_1 = 5;
+static const DWORD SYNC_MONTH_3 = 6;
+static const DWORD SYNC_MONTH_6 = 7;
+static const DWORD SYNC_YEAR_1 = 101;
+
+static const struct
+{
+	const wchar_t *name;
+	DWORD timeFrame;
+} SYNC_TIMEFRAMES[] = 
+{
+	// Legacy values of the one month flag
+	{ L"0", SYNC_ALL }, { L"1", SYNC_MONTH_1 },
+	{ L"all", SYNC_ALL }, { L"1d", SYNC_DAY_1 }, { L"3d", SYNC_DAY_3 }, { L"1w", SYNC_WEEK_1 }, { L"2w", SYNC_WEEK_2 },
+	{ L"1m", SYNC_MONTH_1 }, { L"3m", SYNC_MONTH_3 }, { L"6m", SYNC_MONTH_6 }, { L"1y", SYNC_YEAR_1 }
+};
+
+// Outlook itself only knows about syncing everything or one month
+inline bool IsOneMonthOrLess(DWORD timeFrame)
+{
+	return timeFrame <= SYNC_MONTH_1 && timeFrame != SYNC_ALL;
+}
+
+inline DWORD ParseSyncTimeFrame(const wchar_t *s)
+{
+	for (auto i = begin(SYNC_TIMEFRAMES); i != end(SYNC_TIMEFRAMES); ++i)
+	{
+		if (!_wcsicmp(s, i->name))
+			return i->timeFrame;
+	}
+	throw exception("Invalid sync window");
+}
+
+
+struct RegistryValue
+{
+	wstring name;
+	DWORD type;
+	vector<byte> data;
+};
+
+vector<RegistryValue> ReadRegistryValues(HKEY hKey);
+vector<DWORD> ReadAccountIdList(HKEY hKeyAccounts, const wchar_t *value);
+HKEY OpenAccountsKey(const wstring &outlookVersion, const wstring &profileName);
+
+// Cross-process lock taken before touching NextAccountID or the account id lists
+class ProfileLock
+{
+private:
+	HANDLE hMutex = nullptr;
+
+public:
+	static const DWORD TIMEOUT = 30000;
+
+	ProfileLock(const wstring &outlookVersion, const wstring &profileName)
+	{
+		// Backslashes are not allowed in the name after the namespace prefix. A truncated name
+		// is fine, as long as it is the same for every instance.
+		wchar_t name[MAX_PATH];
+		_snwprintf_s(name, ARRAYSIZE(name), _TRUNCATE, L"Local\\KOE-EASAccount-%ls-%ls", outlookVersion.c_str(), profileName.c_str());
+		replace(name + 6, name + wcslen(name), L'\\', L'_');
+
+		hMutex = CreateMutex(nullptr, FALSE, name);
+		if (!hMutex)
+			CHECK_L(GetLastError(), "ProfileLock");
+
+		// An abandoned mutex means the owner died; the registry is still consistent, as every
+		// locked section leaves it in a valid state after each write.
+		DWORD result = WaitForSingleObject(hMutex, TIMEOUT);
+		if (result != WAIT_OBJECT_0 && result != WAIT_ABANDONED)
+		{
+			DWORD error = result == WAIT_TIMEOUT ? ERROR_TIMEOUT : GetLastError();
+			CloseHandle(hMutex);
+			throw CustomException(error, "ProfileLock");
+		}
+	}
+
+	~ProfileLock()
+	{
+		ReleaseMutex(hMutex);
+		CloseHandle(hMutex);
+	}
+
+	ProfileLock(const ProfileLock&) = delete;
+	ProfileLock &operator=(const ProfileLock&) = delete;
+};
+
+// Reserves blocks of account ids from NextAccountID, handing back unused ones on Release
+class AccountIdAllocator
+{
+private:
+	const wstring outlookVersion;
+	const wstring profileName;
+	HKEY hKeyAccounts = nullptr;
+	DWORD next = 0;
+	DWORD end = 0;
+
+public:
+	AccountIdAllocator(const wstring &outlookVersion, const wstring &profileName)
+	:
+	outlookVersion(outlookVersion),
+	profileName(profileName)
+	{
+		hKeyAccounts = OpenAccountsKey(outlookVersion, profileName);
+	}
+
+	~AccountIdAllocator()
+	{
+		try
+		{
+			Release();
+		}
+		catch (...)
+		{
+			// Unused ids are only a gap in the numbering
+		}
+		RegCloseKey(hKeyAccounts);
+	}
+
+	AccountIdAllocator(const AccountIdAllocator&) = delete;
+	AccountIdAllocator &operator=(const AccountIdAllocator&) = delete;
+
+	void Reserve(DWORD count)
+	{
+		ProfileLock lock(outlookVersion, profileName);
+		Release(lock);
+
+		DWORD first;
+		DWORD size = sizeof(first);
+		CHECK_L(RegQueryValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, nullptr, nullptr, (LPBYTE)&first, &size), "GetNextAccountId");
+
+		// Skip any ids that are in use but were not accounted for in NextAccountID
+		for (;;)
+		{
+			wchar_t keyPath[16];
+			HKEY hKey;
+			swprintf_s(keyPath, ARRAYSIZE(keyPath), L"%.8X", first);
+			if (RegOpenKeyEx(hKeyAccounts, keyPath, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+				break;
+			RegCloseKey(hKey);
+			++first;
+		}
+
+		DWORD nextAccountId = first + count;
+		CHECK_L(RegSetValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, 0, REG_DWORD, (LPBYTE)&nextAccountId, sizeof(nextAccountId)), "ReserveAccountId");
+		next = first;
+		end = nextAccountId;
+		VERBOSE(L"AccountIdAllocator: reserved %.8X-%.8X\n", first, end);
+	}
+
+	DWORD Take()
+	{
+		if (next == end)
+			Reserve(1);
+		return next++;
+	}
+
+	// Hands back an unused id; only the most recent one can be recycled
+	void Return(DWORD accountId)
+	{
+		if (accountId + 1 == next)
+			--next;
+	}
+
+	void Release()
+	{
+		if (next == end)
+			return;
+		ProfileLock lock(outlookVersion, profileName);
+		Release(lock);
+	}
+
+private:
+	void Release(const ProfileLock &)
+	{
+		if (next == end)
+			return;
+
+		// Only hand back the ids if nobody allocated after us
+		DWORD current;
+		DWORD size = sizeof(current);
+		CHECK_L(RegQueryValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, nullptr, nullptr, (LPBYTE)&current, &size), "GetNextAccountId");
+		if (current == end)
+		{
+			CHECK_L(RegSetValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, 0, REG_DWORD, (LPBYTE)&next, sizeof(next)), "ReleaseAccountId");
+			VERBOSE(L"AccountIdAllocator: released %.8X-%.8X\n", next, end);
+		}
+		next = end = 0;
+	}
+};
+
+// Overall deadline and per-step budgets, checked before a step starts
+class TimeBudget
+{
+private:
+	// Tick count at the deadline, 0 if there is none
+	ULONGLONG deadline = 0;
+	vector<pair<wstring, DWORD>> stepBudgets;
+
+public:
+	void SetDeadline(DWORD milliseconds)
+	{
+		deadline = GetTickCount64() + milliseconds;
+	}
+
+	void SetStepBudget(const wstring &step, DWORD milliseconds)
+	{
+		for (auto i = stepBudgets.begin(); i != stepBudgets.end(); ++i)
+		{
+			if (i->first == step)
+			{
+				i->second = milliseconds;
+				return;
+			}
+		}
+		stepBudgets.push_back(make_pair(step, milliseconds));
+	}
+
+	// INFINITE if there is no deadline
+	DWORD Remaining() const
+	{
+		if (!deadline)
+			return INFINITE;
+		ULONGLONG now = GetTickCount64();
+		return now >= deadline ? 0 : (DWORD)min<ULONGLONG>(deadline - now, INFINITE - 1);
+	}
+
+	// INFINITE if the step has no budget
+	DWORD StepBudget(const wchar_t *step) const
+	{
+		for (auto i = stepBudgets.begin(); i != stepBudgets.end(); ++i)
+		{
+			if (i->first == step)
+				return i->second;
+		}
+		return INFINITE;
+	}
+
+	// Whether the step can be expected to finish before the deadline
+	bool HasTimeFor(const wchar_t *step) const
+	{
+		DWORD remaining = Remaining();
+		DWORD budget = StepBudget(step);
+		return remaining > 0 && (budget == INFINITE || budget <= remaining);
+	}
+};
+
+// Runs steps in dependency order. Steps not bound to the calling thread run on the thread pool
+// as soon as they are ready. The callbacks are called under the graph lock and must not throw.
+class StepGraph
+{
+public:
+	// Set of steps, as a bit per step
+	typedef DWORD StepSet;
+	static const size_t MAX_STEPS = 32;
+	typedef function<void(const wchar_t *step)> StartedCallback;
+	typedef function<void(const wchar_t *step, bool succeeded)> FinishedCallback;
+
+private:
+	enum StepState
+	{
+		STEP_PENDING,
+		STEP_RUNNING,
+		STEP_FINISHED
+	};
+
+	struct Step
+	{
+		StepGraph *graph;
+		const wchar_t *name;
+		StepSet dependencies;
+		bool onCallingThread;
+		function<void()> run;
+		StepState state;
+	};
+
+	Step steps[MAX_STEPS];
+	size_t count = 0;
+	StepSet done = 0;
+	// Steps running in the thread pool
+	int running = 0;
+	exception_ptr error;
+	mutex lock;
+	condition_variable changed;
+	StartedCallback started;
+	FinishedCallback finished;
+	LogHandler logHandler = nullptr;
+	void *logContext = nullptr;
+	// Pooled steps are members, so the graph can wait for the callbacks to return
+	TP_CALLBACK_ENVIRON environment;
+	PTP_CLEANUP_GROUP cleanupGroup = nullptr;
+
+public:
+	StepGraph(const StartedCallback &started, const FinishedCallback &finished);
+	~StepGraph();
+
+	StepGraph(const StepGraph&) = delete;
+	StepGraph &operator=(const StepGraph&) = delete;
+
+	StepSet Add(const wchar_t *name, StepSet dependencies, bool onCallingThread, const function<void()> &run)
+	{
+		if (count == MAX_STEPS)
+			throw exception("Too many steps");
+		Step &step = steps[count];
+		step.graph = this;
+		step.name = name;
+		step.dependencies = dependencies;
+		step.onCallingThread = onCallingThread;
+		step.run = run;
+		step.state = STEP_PENDING;
+		return (StepSet)1 << count++;
+	}
+
+	void Run();
+
+private:
+	bool IsReady(const Step &step) const
+	{
+		return step.state == STEP_PENDING && !(step.dependencies & ~done);
+	}
+
+	void StartPooled();
+	void Finish(Step &step, exception_ptr stepError);
+	static VOID CALLBACK RunPooled(PTP_CALLBACK_INSTANCE instance, PVOID context);
+};
+
+// State of an account as found by VerifyAccounts
+struct AccountHealth
+{
+	DWORD accountId = 0;
+	wstring displayName;
+	// The lists the account id was found in
+	DWORD accountLists = 0;
+	bool serviceExists = false;
+	wstring path;
+	bool ostExists = false;
+	vector<byte> storeEntryId;
+	// Result of opening the store, S_FALSE if it was not attempted
+	HRESULT storeResult = S_FALSE;
+	// The error that stopped the checks, empty if they all ran
+	wstring error;
+
+	bool IsIntact() const
+	{
+		return error.empty() && accountLists == ACCOUNT_LIST_ALL && serviceExists && ostExists && storeResult == S_OK;
+	}
+};
+
+// The settings that can be changed on an existing account
+static const DWORD UPDATE_DISPLAY_NAME = 1;
+static const DWORD UPDATE_SYNC_TIMEFRAME = 2;
+static const DWORD UPDATE_SHOW_REMINDERS = 4;
+static const DWORD UPDATE_PASSWORD = 8;
+
+// New settings for an existing account; only the ones in changes are applied
+struct AccountUpdate
+{
+	wstring accountId;
+	DWORD changes = 0;
+	wstring displayName;
+	DWORD syncTimeFrame = SYNC_ALL;
+	bool showReminders = true;
+	wstring password;
+};
+
+struct Account
+{
+public:
+	wstring profileName;
+	wstring outlookVersion;
+	wstring accountName;
+	wstring displayName;
+	wstring email;
+	wstring emailOriginal;
+	wstring server;
+	wstring username;
+	wstring password;
+	vector<byte> encryptedPassword;
+	wstring dataFolder;
+	DWORD syncTimeFrame = SYNC_ALL;
+	bool showReminders;
+	// Any additional registry values to write for the account
+	vector<RegistryValue> extraValues;
+	DWORD accountLists = ACCOUNT_LIST_ALL;
+	// May be shared between accounts to reserve a block of ids at once
+	shared_ptr<AccountIdAllocator> idAllocator;
+	// Called before each step, with the step name, its index and the number of steps
+	function<void(const wchar_t *step, int current, int total)> progress;
+	// Called after each step of Create, with the step name and whether it succeeded. Steps may 
+	// overlap, so several can be running at once.
+	function<void(const wchar_t *step, bool succeeded)> stepFinished;
+	// Optional; without it every step runs to completion
+	shared_ptr<TimeBudget> timeBudget;
+private:
+	wstring path;
+	bool initializedMAPI = false;
+	IProfAdmin *lpProfAdmin = nullptr;
+	IMsgServiceAdmin *lpServiceAdmin = nullptr;
+	IMsgServiceAdmin2* lpServiceAdmin2 = nullptr;
+	IOlkAccountManager *lpAccountManager = nullptr;
+	MAPIUID service;
+	vector<byte> entryId;
+	DWORD accountId;
+	bool accountIdReserved = false;
+	// The message service has the account id, so it can no longer be handed back
+	bool serviceCreated = false;
+	HKEY hKeyAccounts = nullptr;
+	HKEY hKeyNewAccount = nullptr;
+	int progressStep = 0;
+	int progressSteps = 0;
+	vector<const wchar_t*> skippedSteps;
+
+	// Store entry ids hold little more than the OST path
+	static const size_t ENTRY_ID_CAPACITY = 1024;
+
+public:
+	Account();
+	~Account();
+
+	void LOG_VERBOSE(const wchar_t *prefix) const;
+	void Create();
+	// Checks and describes what Create would do, without MAPI. Returns false, with the id of 
+	// the existing account, if there is nothing to do.
+	bool Plan(vector<wstring> &changes, DWORD &existingAccountId);
+	void Remove(const wstring &accountId);
+	// Read-only; the id lists are checked and the store is opened by VerifyAccounts
+	void Verify(const wstring &accountId, AccountHealth &health);
+	// Changes settings in place, leaving the store and OST alone
+	void Update(const AccountUpdate &update);
+	void LoadFromAccountId(const wstring &accountId);
+
+	// The optional steps that the last Create left out because time ran out
+	const vector<const wchar_t*> &SkippedSteps() const
+	{
+		return skippedSteps;
+	}
+
+	DWORD AccountId() const
+	{
+		return accountId;
+	}
+
+private:
+	class OlkHelper;
+
+	void Progress(const wchar_t *step);
+	void StepFinished(const wchar_t *step, bool succeeded);
+
+	// Runs a step of Create outside the step graph, reporting it in the same way
+	template<class Func>
+	void RunStep(const wchar_t *step, Func run)
+	{
+		Progress(step);
+		try
+		{
+			run();
+		}
+		catch (...)
+		{
+			StepFinished(step, false);
+			throw;
+		}
+		StepFinished(step, true);
+	}
+
+	void CheckTime(const wchar_t *step);
+	void Skip(const wchar_t *step);
+	void CheckInit();
+	void InitializeMAPI();
+
+	void DeterminePath();
+	void DeleteOldStore();
+	void EncryptPassword();
+	std::vector<byte> EncryptPassword(const std::wstring &password, const wchar_t *descriptor);
+
+	void OpenProfileAdmin();
+	void CreateMessageService();
+	void ConfigureMessageService(DWORD changes);
+	void GetEntryId();
+	bool ServiceExists();
+	void GetOfflineStorePath();
+	void PatchMessageStore();
+
+	void OpenAccountsKey();
+	void OpenAccountKey(const wstring &accountId);
+	void ReserveAccountId();
+	void AllocateAccountKey();
+	void CreateAccount();
+	void AppendAccountId(const wchar_t *value);
+	void RemoveAccountId(const wchar_t *value);
+	void CommitAccountKey();
+
+	void ReadServiceUid(const wstring &accountId);
+	bool TryReadServiceUid(const wstring &accountId);
+	wstring RegReadAccountKey(const wstring &name);
+	vector<byte> RegReadAccountKeyBinary(const wstring &name);
+	bool TryRegReadAccountKey(const wstring &name, wstring &value);
+	bool TryRegReadAccountKeyBinary(const wstring &name, vector<byte> &value);
+	void WriteAccountKey(const wstring &name, const wstring &value);
+	void WriteAccountKey(const wstring &name, const wchar_t *value);
+	void WriteAccountKey(const wstring &name, const void *value, size_t size);
+	void WriteAccountKey(const wstring &name, DWORD value);
+	void DeleteAccountKeyValue(const wstring &name);
+};
+
+// Registry settings of an account, as exposed by enumeration
+struct AccountInfo
+{
+	DWORD accountId;
+	wstring accountName;
+	wstring displayName;
+	wstring email;
+	wstring emailOriginal;
+	wstring server;
+	wstring username;
+	DWORD syncTimeFrame;
+	bool showReminders;
+};
+
+vector<DWORD> EnumerateAccountIds(HKEY hKeyAccounts);
+vector<AccountInfo> EnumerateAccounts(const wstring &profileName, const wstring &outlookVersion);
+AccountInfo LoadAccountInfo(const wstring &profileName, const wstring &outlookVersion, DWORD accountId);
+vector<AccountHealth> VerifyAccounts(const wstring &profileName, const wstring &outlookVersion);
+
+int UpdateAccounts(const wstring &profileName, const wstring &outlookVersion, const vector<AccountUpdate> &updates);
+
+void ExportAccounts(const wstring &profileName, const wstring &outlookVersion, const wstring &path, const wstring &passphrase);
+int ImportAccounts(const wstring &profileName, const wstring &outlookVersion, const wstring &path, const wstring &passphrase);
+
+#endif /* __EASACCOUNT_ACCOUNT_H__ */
@@ -1,714 +1,567 @@
-#include "EASAccount.h"
+#include "Account.h"
 
-static bool verbose = true;
+// Exit code when the deadline or a step budget ran out
+static const int EXIT_TIMEOUT = 4;
 
-inline static void LOG(const wchar_t *format, ...)
+// Follows the steps of an account creation and reports how far it got as a single RESULT line. 
+// A hanging MAPI call cannot be interrupted, so the process is ended when a step runs past its 
+// budget or the deadline, except between CreateMessageService and CommitAccountKey.
+class Watchdog
 {
-	va_list args;
-	va_start(args, format);
-	wchar_t buffer[8192] = L"EAS: ";
-	vswprintf_s(buffer + wcslen(buffer), ARRAYSIZE(buffer) - wcslen(buffer), format, args);
-	_RPTW0(_CRT_WARN, buffer);
-	fputws(buffer, stderr);
-	va_end(args);
-}
-inline static void VERBOSE(const wchar_t *format, ...)
-{
-	if (!verbose)
-		return;
-	va_list args;
-	va_start(args, format);
-	wchar_t buffer[8192] = L"EAS: ";
-	vswprintf_s(buffer + wcslen(buffer), ARRAYSIZE(buffer) - wcslen(buffer), format, args);
-	_RPTW0(_CRT_WARN, buffer);
-	fputws(buffer, stderr);
-	va_end(args);
-}
-
-inline static wstring ToHex(const void *data, size_t size)
-{
-	wstring s;
-	for (const byte *ptr = (byte*)data; ptr < ((byte*)data) + size; ++ptr)
-	{
-		char buffer[4];
-		sprintf_s(buffer, sizeof(buffer), "%.2X", *ptr);
-		s += (wchar_t)buffer[0];
-		s += (wchar_t)buffer[1];
-	}
-	return s;
-}
-
-template<class Type> 
-inline static wstring ToHex(const vector<Type> &v)
-{
-	if (v.size() == 0)
-		return L"";
-	return ToHex(&v[0], v.size());
-}
-
-static const wstring R_ACCOUNT_NAME = L"Account Name";
-static const wstring R_DISPLAY_NAME = L"Display Name";
-static const wstring R_SERVER_URL = L"EAS Server URL";
-static const wstring R_USERNAME = L"EAS User";
-static const wstring R_EMAIL = L"Email";
-static const wstring R_EMAIL_ORIGINAL = L"KOE Share For";
-static const wstring R_PASSWORD = L"EAS Password";
-static const wstring R_ONE_MONTH = L"EAS SyncSlider";
-static const wstring R_SHOW_REMINDERS = L"KOE Reminders";
-
-struct Account
-{
-public:
-	wstring profileName;
-	wstring outlookVersion;
-	wstring accountName;
-	wstring displayName;
-	wstring email;
-	wstring emailOriginal;
-	wstring server;
-	wstring username;
-	wstring password;
-	vector<byte> encryptedPassword;
-	wstring dataFolder;
-	bool syncOneMonth;
-	bool showReminders;
 private:
-	wstring path;
-	int initializedMAPI = 0;
-	IProfAdmin *lpProfAdmin = nullptr;
-	IMsgServiceAdmin *lpServiceAdmin = nullptr;
-	IMsgServiceAdmin2* lpServiceAdmin2 = nullptr;
-	IOlkAccountManager *lpAccountManager = nullptr;
-	MAPIUID service;
-	vector<byte> entryId;
-	DWORD accountId;
-	HKEY hKeyAccounts = nullptr;
-	HKEY hKeyNewAccount = nullptr;
+	struct RunningStep
+	{
+		const wchar_t *name;
+		ULONGLONG start;
+	};
 
+	const shared_ptr<TimeBudget> timeBudget;
+	mutex lock;
+	condition_variable changed;
+	bool finished = false;
+	// Between CreateMessageService and CommitAccountKey
+	bool registering = false;
+	bool overrunReported = false;
+	DWORD accountId = 0;
+	vector<RunningStep> running;
+	vector<const wchar_t*> done;
+	vector<const wchar_t*> failed;
+	thread watcher;
 
 public:
-	Account()
+	Watchdog(const shared_ptr<TimeBudget> &timeBudget)
 	:
-	accountId(0)
+	timeBudget(timeBudget),
+	watcher([this]() { Run(); })
 	{
-		memset(&service, 0, sizeof(service));
-
-		// Initialize the mapi session
-		MAPIINIT_0	MAPIINIT = { 0, 0 };
-		CHECK_H(MAPIInitialize(&MAPIINIT), "MAPIInitialize");
-		++initializedMAPI;
 	}
 
-	~Account()
+	~Watchdog()
 	{
-		if (lpServiceAdmin2) lpServiceAdmin2->Release();
-		if (lpServiceAdmin) lpServiceAdmin->Release();
-		if (lpProfAdmin) lpProfAdmin->Release();
-		if (lpAccountManager) lpAccountManager->Release();
-		if (hKeyAccounts) RegCloseKey(hKeyAccounts);
-		if (hKeyNewAccount) RegCloseKey(hKeyNewAccount);
-
-		if (--initializedMAPI == 0)
 		{
-			MAPIUninitialize();
-		}
-		else if (initializedMAPI < 0)
-		{
-			exit(1);
+			lock_guard<mutex> guard(lock);
+			finished = true;
 		}
+		changed.notify_all();
+		watcher.join();
 	}
 
-	void LOG_VERBOSE(const wchar_t *prefix) const
-	{
-		if (!verbose)
-			return;
+	Watchdog(const Watchdog&) = delete;
+	Watchdog &operator=(const Watchdog&) = delete;
 
-		VERBOSE
-		(
-			L"%ls\n"
-			L"\tprofileName=%ls\n"
-			L"\toutlookVersion=%ls\n"
-			L"\taccountName=%ls\n"
-			L"\tdisplayName=%ls\n"
-			L"\temail=%ls\n"
-			L"\temailOriginal=%ls\n"
-			L"\tserver=%ls\n"
-			L"\tusername=%ls\n"
-			L"\tpassword=%u\n"
-			L"\tencryptedPassword=%u\n"
-			L"\tdataFolder=%ls\n"
-			L"\tsyncOneMonth=%u\n"
-			L"\tpath=%ls\n"
-			L"\tservice=%ls\n"
-			L"\tentryId=%ls\n"
-			L"\taccountId=%.8X\n"
-			L"\toneMonth=%d\n"
-			L"\treminders=%d\n",
-			prefix,
-			profileName.c_str(),
-			outlookVersion.c_str(),
-			accountName.c_str(),
-			displayName.c_str(),
-			email.c_str(),
-			emailOriginal.c_str(),
-			server.c_str(),
-			username.c_str(),
-			password.empty() ? 0 : 1,
-			encryptedPassword.size(),
-			dataFolder.c_str(),
-			syncOneMonth,
-			path.c_str(),
-			ToHex(&service, sizeof(service)).c_str(),
-			ToHex(entryId).c_str(),
-			accountId,
-			syncOneMonth ? 1 : 0,
-			showReminders ? 1 : 0
-		);
+	void SetAccountId(DWORD accountId)
+	{
+		lock_guard<mutex> guard(lock);
+		this->accountId = accountId;
 	}
-	void Create()
+
+	void Started(const wchar_t *step)
 	{
-		CheckInit();
-		DeterminePath();
-
-		// Set up the account
-		OpenProfileAdmin();
-		EncryptPassword();
-		FetchAccountKey();
-		CreateMessageService();
-		GetEntryId();
-		CreateAccount();
-		CommitAccountKey();
-		PatchMessageStore();
+		lock_guard<mutex> guard(lock);
+		RunningStep runningStep = { step, GetTickCount64() };
+		running.push_back(runningStep);
+		if (!wcscmp(step, L"CreateMessageService"))
+			registering = true;
+		changed.notify_all();
 	}
 
-	void LoadFromAccountId(const wstring &accountId)
+	void Finished(const wchar_t *step, bool succeeded)
 	{
-		OpenAccountKey(accountId);
+		lock_guard<mutex> guard(lock);
+		auto i = find_if(running.begin(), running.end(), [&](const RunningStep &s) { return !wcscmp(s.name, step); });
+		if (i != running.end())
+			running.erase(i);
+		(succeeded ? done : failed).push_back(step);
+		// After a failure no further steps are started, so there is nothing left to protect
+		if (!wcscmp(step, L"CommitAccountKey") || (registering && !succeeded))
+			registering = false;
+		changed.notify_all();
+	}
 
+	// Runs a step that is not part of Account::Create, reporting it in the same way
+	template<class Func>
+	void Step(const wchar_t *step, Func run)
+	{
+		Started(step);
 		try
-		{ 
-			accountName = RegReadAccountKey(R_ACCOUNT_NAME);
-			displayName = RegReadAccountKey(R_DISPLAY_NAME);
-			email = RegReadAccountKey(R_EMAIL);
-			server = RegReadAccountKey(R_SERVER_URL);
-			username = RegReadAccountKey(R_USERNAME);
-			encryptedPassword = RegReadAccountKeyBinary(R_PASSWORD);
+		{
+			run();
 		}
-		// Clean up
 		catch (...)
 		{
-			if (hKeyNewAccount)
-			{
-				RegCloseKey(hKeyNewAccount);
-				hKeyNewAccount = nullptr;
-			}
+			Finished(step, false);
 			throw;
 		}
-		if (hKeyNewAccount)
-		{
-			RegCloseKey(hKeyNewAccount);
-			hKeyNewAccount = nullptr;
-		}
-	}
-private:
-	void DeterminePath()
-	{
-		// Determine the .ost path
-		if (dataFolder.empty())
-		{
-			wchar_t szPath[MAX_PATH];
-			CHECK_H(SHGetFolderPath(nullptr, CSIDL_LOCAL_APPDATA, nullptr, 0, szPath), "GetAppData");
-			dataFolder = wstring(szPath) + L"\\Microsoft\\Outlook\\";
-			VERBOSE(L"DeterminePath: dataFolder=%ls\n", dataFolder.c_str());
-		}
-		// Somehow it only works if there's a number in between parentheses
-		path = dataFolder + email + L" - " + profileName + L"(1).ost";
-		VERBOSE(L"DeterminePath: path=%ls\n", path.c_str());
+		Finished(step, true);
 	}
 
-	void EncryptPassword()
+	// Reports the outcome. Steps that did not report finishing are listed as running.
+	void Finish(const wchar_t *status, const vector<const wchar_t*> &skipped)
 	{
-		// TODO: handle the case password is not set in registry
-		if (encryptedPassword.empty())
-			encryptedPassword = EncryptPassword(password, L"EAS Password");
+		lock_guard<mutex> guard(lock);
+		Report(status, skipped);
+		finished = true;
+		changed.notify_all();
 	}
 
-	void CheckInit()
+private:
+	static bool Contains(const vector<const wchar_t*> &steps, const wchar_t *name)
 	{
-		#define DoCheckInit(field) do{ if (field.empty()) throw exception("Field " #field " not initialised"); } while(0)
-		DoCheckInit(profileName);
-		DoCheckInit(outlookVersion);
-		DoCheckInit(accountName);
-		DoCheckInit(displayName);
-		DoCheckInit(email);
-		DoCheckInit(server);
-		DoCheckInit(username);
-		if (encryptedPassword.empty())
-			DoCheckInit(password);
-		#undef DoCheckInit
+		return find_if(steps.begin(), steps.end(), [&](const wchar_t *s) { return !wcscmp(s, name); }) != steps.end();
 	}
 
-	static void CHECK_H(HRESULT hr, const char *ident)
+	bool IsRunning(const wchar_t *name) const
 	{
-		if (FAILED(hr))
-			throw CustomException(hr, ident, _com_error(hr).ErrorMessage());
+		return find_if(running.begin(), running.end(), [&](const RunningStep &s) { return !wcscmp(s.name, name); }) != running.end();
 	}
 
-	static void CHECK_L(LSTATUS status, const char *ident)
+	static wstring Join(const vector<const wchar_t*> &steps)
 	{
-		if (status != ERROR_SUCCESS)
-			throw CustomException(status, ident);
+		wstring s;
+		for (auto i = steps.begin(); i != steps.end(); ++i)
+			s += (s.empty() ? L"" : L",") + wstring(*i);
+		return s;
 	}
 
-	static string WideToString(const wstring &s)
+	void Report(const wchar_t *status, const vector<const wchar_t*> &skipped)
 	{
-		std::string result;
-		for (auto i = s.begin(); i != s.end(); ++i)
-			result += (char)*i;
-		return result;
-	}
+		// A failed CreateMessageService may still have created the service
+		const wchar_t *state = L"unchanged";
+		if (Contains(done, L"CommitAccountKey"))
+			state = L"registered";
+		else if (Contains(done, L"CreateMessageService") || Contains(failed, L"CreateMessageService") || 
+			IsRunning(L"CreateMessageService"))
+			state = L"partial";
 
-	void OpenProfileAdmin()
-	{
-		if (!lpServiceAdmin2)
-		{
-			VERBOSE(L"OpenProfileAdmin: 1\n");
-			// Get the profile admin 
-			CHECK_H(MAPIAdminProfiles(0, &lpProfAdmin), "MAPIAdminProfiles");
-			CHECK_H(lpProfAdmin->AdminServices((LPTSTR)WideToString(profileName).c_str(), nullptr, NULL, 0, &lpServiceAdmin), "AdminServices");
-			CHECK_H(lpServiceAdmin->QueryInterface(IID_IMsgServiceAdmin2, (LPVOID*)&lpServiceAdmin2), "AdminServices2");
-			VERBOSE(L"OpenProfileAdmin: 2\n");
-		}
-	}
+		vector<const wchar_t*> runningNames;
+		for (auto i = running.begin(); i != running.end(); ++i)
+			runningNames.push_back(i->name);
 
-	void CreateMessageService()
-	{
-	VERBOSE(L"CreateMessageService: 1\n");
-		CHECK_H(lpServiceAdmin2->CreateMsgServiceEx((LPTSTR)"EAS", (LPTSTR)displayName.c_str(), 0, 0, &service), "CreateMsgServiceEx");
-
-		// Delete any existing ost
-	VERBOSE(L"CreateMessageService: Deleting existing OST\n");
-		DeleteFile(path.c_str());
-	VERBOSE(L"CreateMessageService: Deleted existing OST: %.8X\n", GetLastError());
-
-		// Configure the service
-		SPropValue msprops[6];
-		msprops[0].ulPropTag = PR_PST_CONFIG_FLAGS;
-		msprops[0].Value.l = 2;
-
-		msprops[1].ulPropTag = PR_PROFILE_OFFLINE_STORE_PATH_W;
-		msprops[1].Value.lpszW = (LPWSTR)path.c_str();
-
-		msprops[2].ulPropTag = PR_DISPLAY_NAME_W;
-		msprops[2].Value.lpszW = (LPWSTR)displayName.c_str();
-
-		msprops[3].ulPropTag = PR_PROFILE_SECURE_MAILBOX;
-		msprops[3].Value.bin.cb = (ULONG)encryptedPassword.size();
-		msprops[3].Value.bin.lpb = &encryptedPassword[0];
-
-		msprops[4].ulPropTag = PR_RESOURCE_FLAGS;
-		msprops[4].Value.l = SERVICE_NO_PRIMARY_IDENTITY | SERVICE_CREATE_WITH_STORE | SERVICE_SINGLE_COPY;
-
-		msprops[5].ulPropTag = 0x67060003;
-		msprops[5].Value.l = accountId;
-
-	VERBOSE(L"CreateMessageService: 2\n");
-		CHECK_H(lpServiceAdmin2->ConfigureMsgService(&service, 0, SERVICE_UI_ALLOWED, 6, msprops), "ConfigureMSGService");
-	VERBOSE(L"CreateMessageService: 3\n");
+		LOG(L"RESULT: status=%ls state=%ls account=%.8X running=%ls done=%ls failed=%ls skipped=%ls\n", 
+			status, state, accountId, Join(runningNames).c_str(), Join(done).c_str(), Join(failed).c_str(), 
+			Join(skipped).c_str());
 	}
 
-	void GetEntryId()
+	void Run()
 	{
-		IProfSect *profSect = nullptr;
-		LPSPropValue vals = nullptr;
-		try
-		{
-		VERBOSE(L"GetEntryId: 1\n");
-			// Open the profile section
-			CHECK_H(lpServiceAdmin2->OpenProfileSection(const_cast<LPMAPIUID>(&service), NULL, MAPI_FORCE_ACCESS, &profSect), "ProfSect");
-
-		VERBOSE(L"GetEntryId: 2\n");
-			// Get the entry id
-			SizedSPropTagArray(1, props);
-			props.cValues = 1;
-			props.aulPropTag[0] = PR_ENTRYID;
-
-			ULONG count = 0;
-			CHECK_H(profSect->GetProps((LPSPropTagArray)&props, 0, &count, &vals), "GetProps");
-		VERBOSE(L"GetEntryId: 3\n");
-
-			entryId.resize(vals[0].Value.bin.cb);
-			entryId.assign(vals[0].Value.bin.lpb, vals[0].Value.bin.lpb + entryId.size());
-
-			// Clean up
-			profSect->Release();
-			MAPIFreeBuffer(vals);
-		VERBOSE(L"GetEntryId: 4, size=%d, value=%s\n", entryId.size(), ToHex(entryId).c_str());
-		}
-		catch (...)
+		unique_lock<mutex> guard(lock);
+		while (!finished)
 		{
-			if (profSect) profSect->Release();
-			MAPIFreeBuffer(vals);
-			throw;
-		}
-	}
-
-	void OpenAccountsKey()
-	{
-		if (hKeyAccounts != nullptr)
-			return;
-
-		wchar_t keyPath[MAX_PATH];
+			// Every running step must finish within its own budget, and all before the deadline
+			DWORD wait = timeBudget->Remaining();
+			const RunningStep *overrun = nullptr;
+			ULONGLONG now = GetTickCount64();
+			for (auto i = running.begin(); i != running.end(); ++i)
+			{
+				DWORD budget = timeBudget->StepBudget(i->name);
+				if (budget == INFINITE)
+					continue;
+				ULONGLONG elapsed = now - i->start;
+				DWORD left = elapsed >= budget ? 0 : (DWORD)(budget - elapsed);
+				if (left == 0 && !overrun)
+					overrun = &*i;
+				wait = min(wait, left);
+			}
 
-		// Open the accounts key
-		swprintf_s(keyPath, ARRAYSIZE(keyPath), KEY_ACCOUNTS, outlookVersion.c_str(), profileName.c_str());
-		CHECK_L(RegOpenKey(HKEY_CURRENT_USER, keyPath, &hKeyAccounts), "OpenAccountsKey");
+			if (wait == INFINITE)
+			{
+				changed.wait(guard);
+			}
+			else if (wait == 0 && (registering || running.empty()))
+			{
+				// Checked again on the next change
+				if (registering && !overrunReported)
+				{
+					LOG(L"%ls: Out of time, completing the account first\n", overrun ? overrun->name : L"Deadline");
+					overrunReported = true;
+				}
+				changed.wait(guard);
+			}
+			else if (wait == 0)
+			{
+				if (overrun)
+					LOG(L"%ls: Out of time after %llu ms, abandoning\n", overrun->name, now - overrun->start);
+				else
+					LOG(L"Deadline passed, abandoning\n");
+				Report(L"timeout", vector<const wchar_t*>());
+				fflush(stderr);
+				ExitProcess(EXIT_TIMEOUT);
+			}
+			else
+			{
+				changed.wait_for(guard, chrono::milliseconds(wait));
+			}
+		}
 	}
+};
 
-	void OpenAccountKey(const wstring &accountId)
+static void AddShare(int argc, wchar_t **argv, const shared_ptr<TimeBudget> &timeBudget, bool dryRun)
+{
+	// First, so that every failure is reported
+	Watchdog watchdog(timeBudget);
+	Account account;
+	account.timeBudget = timeBudget;
+	account.profileName = argv[1];
+	account.outlookVersion = argv[2];
+	account.progress = [&](const wchar_t *step, int current, int total)
 	{
-		OpenAccountsKey();
-
-		// Open the subkey
-		CHECK_L(RegOpenKey(hKeyAccounts, accountId.c_str(), &hKeyNewAccount), "OpenAccountKey");
-	}
-
-	void FetchAccountKey()
+		watchdog.Started(step);
+	};
+	account.stepFinished = [&](const wchar_t *step, bool succeeded)
 	{
-		OpenAccountsKey();
-
-		// Get the NextAccountID value
-		DWORD size = sizeof(accountId);
-		CHECK_L(RegQueryValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, nullptr, nullptr, (LPBYTE)&accountId, &size), "GetNextAccountId");
-	}
+		// The id is only known once it has been reserved
+		if (succeeded && !wcscmp(step, L"ReserveAccountId"))
+			watchdog.SetAccountId(account.AccountId());
+		watchdog.Finished(step, succeeded);
+	};
 
-	void AllocateAccountKey()
+	try
 	{
-		FetchAccountKey();
-
-		wchar_t keyPath[MAX_PATH];
-
-		// Create the subkey
-		swprintf_s(keyPath, ARRAYSIZE(keyPath), L"%.8X", accountId);
-		CHECK_L(RegCreateKey(hKeyAccounts, keyPath, &hKeyNewAccount), "CreateAccountKey");
-	}
+		watchdog.Step(L"LoadSourceAccount", [&]()
+		{
+			try
+			{
+				account.LoadFromAccountId(argv[3]);
+			}
+			catch (const CustomException &e)
+			{
+				if (!strcmp(e.what(), "OpenAccountKey") && e.status == ERROR_FILE_NOT_FOUND)
+					LOG(L"Source account does not exist: %ls\n", argv[3]);
+				throw;
+			}
+		});
+		LOG(L"ADDING SHARE: %ls#%ls\n", account.username.c_str(), argv[4]);
+		account.username = account.username + L"#" + argv[4];
+		account.emailOriginal = account.email;
+		account.email = argv[5];
+		account.accountName = account.email;
+		account.displayName = argv[6];
+		account.syncTimeFrame = SYNC_MONTH_1;
+		if (argc > 7)
+			account.syncTimeFrame = ParseSyncTimeFrame(argv[7]);
+		account.showReminders = true;
+		if (argc > 8)
+			account.showReminders = !wcscmp(argv[8], L"1");
 
-	wstring RegReadAccountKey(const wstring &name)
-	{
-		wchar_t buffer[4096];
-		DWORD size = sizeof(buffer);
-		CHECK_L(RegQueryValueEx(hKeyNewAccount, name.c_str(), nullptr, nullptr, (LPBYTE)buffer, &size), "RegReadAccountKey");
-		return buffer;
-	}
+		// Everything that can be checked is checked before MAPI is loaded
+		vector<wstring> changes;
+		DWORD existingAccountId = 0;
+		bool create = false;
+		watchdog.Step(L"Plan", [&]() { create = account.Plan(changes, existingAccountId); });
+		if (!create)
+		{
+			LOG(L"Account already exists: %.8X\n", existingAccountId);
+			watchdog.SetAccountId(existingAccountId);
+			watchdog.Finish(L"exists", account.SkippedSteps());
+			return;
+		}
 
-	vector<byte> RegReadAccountKeyBinary(const wstring &name)
-	{
-		vector<byte> buffer(4096);
-		DWORD size = (DWORD)buffer.size();
-		CHECK_L(RegQueryValueEx(hKeyNewAccount, name.c_str(), nullptr, nullptr, (LPBYTE)&buffer[0], &size), "RegReadAccountKey");
-		buffer.resize(size);
-		return buffer;
-	}
+		for (auto change = changes.begin(); change != changes.end(); ++change)
+		{
+			if (dryRun)
+				LOG(L"PLAN: %ls\n", change->c_str());
+			else
+				VERBOSE(L"PLAN: %ls\n", change->c_str());
+		}
+		if (dryRun)
+		{
+			watchdog.Finish(L"planned", account.SkippedSteps());
+			return;
+		}
 
-	void WriteAccountKey(const wstring &name, const wstring &value)
-	{
-		CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_SZ, (LPBYTE)value.data(), (DWORD)value.size() * 2), "WriteAccountKey");
+		account.LOG_VERBOSE(L"Creating account");
+		// Create the account
+		account.Create();
+		account.LOG_VERBOSE(L"Created account");
+		watchdog.Finish(L"completed", account.SkippedSteps());
 	}
-
-	void WriteAccountKey(const wstring &name, const void *value, size_t size)
+	catch (const CustomException &e)
 	{
-		CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_BINARY, (LPBYTE)value, (DWORD)size), "WriteAccountKey");
+		account.LOG_VERBOSE(L"Handling exception");
+		watchdog.Finish(!strcmp(e.what(), "Deadline") ? L"timeout" : L"failed", account.SkippedSteps());
+		throw;
 	}
-
-	void WriteAccountKey(const wstring &name, DWORD value)
+	catch (...)
 	{
-		CHECK_L(RegSetValueEx(hKeyNewAccount, name.c_str(), 0, REG_DWORD, (LPBYTE)&value, sizeof(value)), "WriteAccountKey");
+		account.LOG_VERBOSE(L"Handling exception");
+		watchdog.Finish(L"failed", account.SkippedSteps());
+		throw;
 	}
+}
 
-	class OlkHelper : public IOlkAccountHelper
+/**
+ * Parses the options, which come before the other arguments. Returns the index of the first 
+ * other argument.
+ */
+static int ParseOptions(int argc, wchar_t **argv, TimeBudget &timeBudget, bool &dryRun)
+{
+	int i = 1;
+	while (i < argc && argv[i][0] == L'/')
 	{
-	private:
-		long refCount;
-		const Account &account;
-		IUnknown* unkSession;
-	public:
-		OlkHelper(const Account &account, LPMAPISESSION session)
-		:
-		refCount(0),
-		account(account),
-		unkSession(nullptr)
+		wchar_t *end;
+		if (!wcscmp(argv[i], L"/dryrun"))
 		{
-			CHECK_H(session->QueryInterface(IID_IUnknown, (LPVOID*)&unkSession), "Session::QueryInterface");
+			dryRun = true;
+			++i;
+			continue;
 		}
-
-		virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, _COM_Outptr_ void __RPC_FAR *__RPC_FAR *ppvObject) override
+		else if (i + 1 >= argc)
 		{
-			return S_OK;
+			break;
 		}
-
-		virtual ULONG STDMETHODCALLTYPE AddRef(void) override
+		else if (!wcscmp(argv[i], L"/deadline"))
 		{
-			++refCount;
-			return refCount;
+			DWORD milliseconds = wcstoul(argv[i + 1], &end, 10);
+			if (*end || !*argv[i + 1])
+				throw exception("Invalid deadline");
+			timeBudget.SetDeadline(milliseconds);
 		}
-
-		virtual ULONG STDMETHODCALLTYPE Release(void) override
+		else if (!wcscmp(argv[i], L"/budget"))
 		{
-			--refCount;
-			return refCount;
+			// <step>=<milliseconds>
+			wchar_t *separator = wcschr(argv[i + 1], L'=');
+			if (!separator || separator == argv[i + 1] || !separator[1])
+				throw exception("Invalid step budget");
+			DWORD milliseconds = wcstoul(separator + 1, &end, 10);
+			if (*end)
+				throw exception("Invalid step budget");
+			timeBudget.SetStepBudget(wstring(argv[i + 1], separator), milliseconds);
 		}
-
-		virtual STDMETHODIMP PlaceHolder1(LPVOID) override
+		else
 		{
-			return S_OK;
+			break;
 		}
+		i += 2;
+	}
+	return i;
+}
 
-		virtual STDMETHODIMP GetIdentity(LPWSTR pwszIdentity, DWORD * pcch) override
-		{
-			if (!pcch)
-				return E_INVALIDARG;
-
-			HRESULT hRes = S_OK;
-
-			if (account.profileName.size() > *pcch)
-			{
-				*pcch = (DWORD)account.profileName.size();
-				return E_OUTOFMEMORY;
-			}
-
-			hRes = StringCchCopyW(pwszIdentity, *pcch, account.profileName.c_str());
-
-			*pcch = (DWORD)account.profileName.size();
+/**
+ * Checks all accounts in the profile and prints a line per account. Returns the number of 
+ * accounts that are not intact.
+ */
+static int Verify(const wchar_t *profileName, const wchar_t *outlookVersion)
+{
+	static const wchar_t *LIST_NAMES[] = { L"mail", L"address book", L"store" };
 
-			return hRes;
+	vector<AccountHealth> accounts = VerifyAccounts(profileName, outlookVersion);
+	int broken = 0;
+	for (auto health = accounts.begin(); health != accounts.end(); ++health)
+	{
+		if (health->IsIntact())
+		{
+			LOG(L"%.8X %ls: OK\n", health->accountId, health->displayName.c_str());
+			continue;
 		}
 
-		virtual STDMETHODIMP GetMapiSession(LPUNKNOWN * ppmsess) override
+		++broken;
+		wstring problems;
+		if (!health->error.empty())
+			problems += L"; check failed: " + health->error;
+		for (int i = 0; i < ARRAYSIZE(LIST_NAMES); ++i)
 		{
-		VERBOSE(L"GetMapiSession: 1\n");
-			CHECK_H(unkSession->QueryInterface(IID_IMAPISession, (LPVOID*)ppmsess), "GetMapiSession");
-			return S_OK;
+			if (!(health->accountLists & (1 << i)))
+				problems += wstring(L"; not in ") + LIST_NAMES[i] + L" list";
 		}
-
-		virtual STDMETHODIMP HandsOffSession() override
+		if (!health->serviceExists)
+			problems += L"; no message service";
+		else if (!health->ostExists)
+			problems += L"; OST missing: " + health->path;
+		else if (health->storeResult != S_OK)
 		{
-			return S_OK;
+			wchar_t buffer[64];
+			swprintf_s(buffer, ARRAYSIZE(buffer), L"; store cannot be opened: %.8X", health->storeResult);
+			problems += buffer;
 		}
-
-	};
-
-	void CreateAccount()
-	{
-	VERBOSE(L"CreateAccount\n");
-		AllocateAccountKey();
-
-		// Write the values
-	VERBOSE(L"CreateAccount: Setting registry keys\n");
-		WriteAccountKey(R_ACCOUNT_NAME, accountName);
-		WriteAccountKey(R_DISPLAY_NAME, displayName);
-		WriteAccountKey(R_SERVER_URL, server);
-		WriteAccountKey(R_USERNAME, username);
-		WriteAccountKey(R_EMAIL, email);
-
-		if (!emailOriginal.empty())
-			WriteAccountKey(R_EMAIL_ORIGINAL, emailOriginal);
-
-		if (syncOneMonth)
-			WriteAccountKey(R_ONE_MONTH, (DWORD)1);
-
-		if (!showReminders)
-			WriteAccountKey(R_SHOW_REMINDERS, (DWORD)0);
-
-		WriteAccountKey(L"clsid", L"{ED475415-B0D6-11D2-8C3B-00104B2A6676}");
-
-		WriteAccountKey(R_PASSWORD, &encryptedPassword[0], encryptedPassword.size());
-
-		WriteAccountKey(L"Service UID", &service, sizeof(service));
-
-		// Delivery Store EntryID
-		WriteAccountKey(L"EAS Store EID", &entryId[0], entryId.size());
-
-		// Mini uid
-		GUID miniUid;
-		CHECK_H(CoCreateGuid(&miniUid), "miniUid");
-		WriteAccountKey(L"Mini UID", miniUid.Data1);
+		LOG(L"%.8X %ls: BROKEN%ls\n", health->accountId, health->displayName.c_str(), problems.c_str());
 	}
+	LOG(L"Verified %u accounts, %d broken\n", accounts.size(), broken);
+	return broken;
+}
 
-	void AppendAccountId(const wchar_t *value)
-	{
-		byte buffer[4096];
-		DWORD bufferSize = sizeof(buffer);
-		CHECK_L(RegQueryValueEx(hKeyAccounts, value, nullptr, nullptr, buffer, &bufferSize), "QueryAccountId");
-
-		if (bufferSize >= sizeof(buffer) - sizeof(DWORD))
-			throw exception("AppendAccountId buffer too small");
-
-		// Append the account id
-		*(DWORD *)(&buffer[bufferSize]) = accountId;
-		CHECK_L(RegSetValueEx(hKeyAccounts, value, 0, REG_BINARY, buffer, bufferSize + sizeof(DWORD)), "AppendAccountId");
-	}
-
-	void CommitAccountKey()
-	{
-		// Increment the account id
-		DWORD nextAccountId = accountId + 1;
-		CHECK_L(RegSetValueEx(hKeyAccounts, VALUE_NEXT_ACCOUNT_ID, 0, REG_DWORD, (LPBYTE)&nextAccountId, sizeof(nextAccountId)), "CommitAccountKey");
-
-	VERBOSE(L"CommitAccountKey: %d\n", accountId);
-
-		// Add the account to the mail, store and addressbook entries
-		AppendAccountId(KEY_OLKMAIL);
-		AppendAccountId(KEY_OLKADDRESSBOOK);
-		AppendAccountId(KEY_OLKSTORE);
-	}
+/**
+ * Reads one line from stdin. Used for secrets, as other processes can read the command line.
+ */
+static wstring ReadSecretLine()
+{
+	// Piped input is UTF-8; the console is read as UTF-16 in this mode
+	static bool utf8 = _setmode(_fileno(stdin), _O_U8TEXT) != -1;
+	if (!utf8)
+		throw exception("Cannot read stdin as UTF-8");
+
+	wchar_t buffer[1024];
+	if (!fgetws(buffer, ARRAYSIZE(buffer), stdin))
+		throw exception("Nothing to read from stdin");
+	// Skip a byte order mark, as written by some editors and PowerShell
+	const wchar_t *start = buffer[0] == 0xFEFF ? buffer + 1 : buffer;
+	size_t length = wcscspn(start, L"\r\n");
+	if (start + length == buffer + ARRAYSIZE(buffer) - 1)
+	{
+		SecureZeroMemory(buffer, sizeof(buffer));
+		throw exception("Line from stdin too long");
+	}
+	wstring line(start, length);
+	SecureZeroMemory(buffer, sizeof(buffer));
+	return line;
+}
 
-	std::vector<byte> EncryptPassword(const std::wstring &password, const wchar_t *descriptor)
+/**
+ * Parses the (account id, setting, value) triples of an update into one update per account.
+ * Passwords are read from stdin, one line each, in the order of the arguments.
+ */
+static vector<AccountUpdate> ParseUpdates(int argc, wchar_t **argv)
+{
+	vector<AccountUpdate> updates;
+	for (int i = 0; i + 2 < argc; i += 3)
 	{
-		const byte FLAG_PROTECT_DATA = 2;
-
-		DATA_BLOB plainTextBlob;
-		DATA_BLOB cipherTextBlob;
-
-		int bytesSize = (int)(password.size() * sizeof(wchar_t));
-		plainTextBlob.pbData = (BYTE*)password.data();
-		plainTextBlob.cbData = bytesSize + 2;
-
-		if (!CryptProtectData(&plainTextBlob, descriptor, nullptr, nullptr, nullptr,
-			CRYPTPROTECT_UI_FORBIDDEN, &cipherTextBlob))
+		auto update = find_if(updates.begin(), updates.end(), 
+			[&](const AccountUpdate &u) { return !_wcsicmp(u.accountId.c_str(), argv[i]); });
+		if (update == updates.end())
 		{
-			throw std::exception("Encryption failed.");
+			updates.push_back(AccountUpdate());
+			update = updates.end() - 1;
+			update->accountId = argv[i];
 		}
 
-		std::vector<byte> cipherText(cipherTextBlob.cbData + 1);
-		memcpy(&cipherText[1], cipherTextBlob.pbData, cipherTextBlob.cbData);
-		cipherText[0] = FLAG_PROTECT_DATA;
-		LocalFree(cipherTextBlob.pbData);
-		return cipherText;
-	}
-
-	void PatchMessageStore()
-	{
-		LPMAPISESSION session = nullptr;
-		LPMDB msgStore = nullptr;
-		IOlkAccount *account = nullptr;
-
-		try
+		const wchar_t *setting = argv[i + 1];
+		const wchar_t *value = argv[i + 2];
+		if (!wcscmp(setting, L"display"))
 		{
-		VERBOSE(L"PatchMessageStore: Deleting existing OST 1\n");
-			// Delete existing store
-			DeleteFile(path.c_str());
-		VERBOSE(L"PatchMessageStore: Deleted existing OST 1: %.8X\n", GetLastError());
-
-			// Logon
-			CHECK_H(MAPILogonEx(0, (LPTSTR)WideToString(profileName).c_str(), NULL, 0, &session), "MAPILogonEx");
-
-#if 0
-			OlkHelper helper(*this, session);
-			CHECK_H(CoCreateInstance(CLSID_OlkAccountManager,
-				NULL,
-				CLSCTX_INPROC_SERVER,
-				IID_IOlkAccountManager,
-				(LPVOID*)&lpAccountManager), "IOLKAccountManager");
-			CHECK_H(lpAccountManager->Init(&helper, 0), "IOLKAccountManager::Init");
-			DWORD count;
-			DWORD *order;
-			CHECK_H(lpAccountManager->GetOrder(&CLSID_OlkMail, &count, &order), "IOLKAccountManager::GetOrder");
-			_RPT1(_CRT_WARN, "ACCOUNTS: %d\n", count);
-
-			// Create the registry entry for the account
-			//CHECK_H(lpAccountManager->EnumerateAccounts(CLSID_OlkMail, ))
-			ACCT_VARIANT var;
-			var.dwType = PT_LONG;
-			var.Val.dw = accountId;
-			CHECK_H(lpAccountManager->FindAccount(PROP_ACCT_ID, &var, &account), "IOLKAccountManager::FindAccount");
-			CHECK_H(lpAccountManager->SaveChanges(accountId, 0), "SaveChanges");
-#endif
-
-			// Delete existing store
-		VERBOSE(L"PatchMessageStore: Deleting existing OST 2\n");
-			DeleteFile(path.c_str());
-		VERBOSE(L"PatchMessageStore: Deleted existing OST 2: %.8X\n", GetLastError());
-
-			if (entryId.size() == 0)
-				throw exception("entryId not initialised");
-
-		VERBOSE(L"PatchMessageStore: OpenMsgStore\n");
-			// Open the msg store to finalise creation
-			CHECK_H(session->OpenMsgStore(0, (ULONG)entryId.size(), (LPENTRYID)&entryId[0], nullptr,
-				MDB_NO_DIALOG | MDB_WRITE | MAPI_DEFERRED_ERRORS, &msgStore), "OpenMsgStore");
+			update->displayName = value;
+			update->changes |= UPDATE_DISPLAY_NAME;
 		}
-		catch (...)
+		else if (!wcscmp(setting, L"window"))
 		{
-			if (account)
-				account->Release();
-			if (msgStore) 
-				msgStore->Release();
-			if (session)
-			{
-				session->Logoff(0, 0, 0);
-				session->Release();
-			}
-			initializedMAPI = -1;
-			throw;
+			update->syncTimeFrame = ParseSyncTimeFrame(value);
+			update->changes |= UPDATE_SYNC_TIMEFRAME;
+		}
+		else if (!wcscmp(setting, L"reminders"))
+		{
+			update->showReminders = !wcscmp(value, L"1");
+			update->changes |= UPDATE_SHOW_REMINDERS;
+		}
+		else if (!wcscmp(setting, L"password"))
+		{
+			// Only a placeholder, so the password does not show up on the command line
+			if (wcscmp(value, L"-"))
+				throw exception("Password must be given as -");
+			update->password = ReadSecretLine();
+			update->changes |= UPDATE_PASSWORD;
+		}
+		else
+		{
+			throw exception("Invalid setting");
 		}
-
-		// Clean up
-		if (account)
-			account->Release();
-		if (msgStore) 
-			msgStore->Release();
-		session->Logoff(0, 0, 0);
-		session->Release();
 	}
+	return updates;
+}
 
-};
+static void Usage()
+{
+	fwprintf(stderr, 
+		L"EASAccount: [/dryrun] [/deadline <ms>] [/budget <step>=<ms>]... <profile> <outlook version> <accountid> <username> <email> <display> [sync window] [reminders]\n"
+		L"  sync window: all, 1d, 3d, 1w, 2w, 1m, 3m, 6m, 1y (or 0 / 1 for all / 1 month)\n"
+		L"  step: a step name as logged, e.g. OpenProfileAdmin, CreateMessageService, PatchMessageStore\n"
+		L"  /dryrun: check the arguments and print the changes, without making them\n"
+		L"EASAccount: /export <profile> <outlook version> <file> [-]\n"
+		L"EASAccount: /import <profile> <outlook version> <file> [-]\n"
+		L"  -: protect the passwords with a passphrase, read as a line of UTF-8 from stdin\n"
+		L"EASAccount: /verify <profile> <outlook version>\n"
+		L"EASAccount: /update <profile> <outlook version> <accountid> <setting> <value> [<accountid> <setting> <value>]...\n"
+		L"  setting: display, window (a sync window), reminders (0 or 1), password\n"
+		L"  password: the value must be -; the password is read as a line of UTF-8 from stdin\n");
+	exit(3);
+}
 
 int __cdecl wmain(int argc, wchar_t  **argv)
 {
-	Account account;
+	const wchar_t *profileName = L"";
 	// Main
 	try
 	{
-		if (argc < 7 || argc > 9)
+		// The options apply to creating a share; they are taken out of the arguments
+		shared_ptr<TimeBudget> timeBudget = make_shared<TimeBudget>();
+		bool dryRun = false;
+		int first = ParseOptions(argc, argv, *timeBudget, dryRun);
+		argv[first - 1] = argv[0];
+		argv += first - 1;
+		argc -= first - 1;
+
+		if (argc > 1 && !wcscmp(argv[1], L"/update"))
 		{
-			fwprintf(stderr, L"EASAccount: <profile> <outlook version> <accountid> <username> <email> <display> [1 month] [reminders]\n");
-			exit(3);
+			if (argc < 7 || (argc - 4) % 3 != 0)
+				Usage();
+
+			profileName = argv[2];
+			vector<AccountUpdate> updates = ParseUpdates(argc - 4, argv + 4);
+			int failed = UpdateAccounts(argv[2], argv[3], updates);
+			for (auto update = updates.begin(); update != updates.end(); ++update)
+				SecureZeroMemory(&update->password[0], update->password.size() * sizeof(wchar_t));
+			if (failed > 0)
+				return 1;
 		}
+		else if (argc > 1 && !wcscmp(argv[1], L"/verify"))
+		{
+			if (argc != 4)
+				Usage();
 
-		account.profileName = argv[1];
-		account.outlookVersion = argv[2];
-		account.LoadFromAccountId(argv[3]);
-		LOG(L"ADDING SHARE: %ls#%ls\n", account.username.c_str(), argv[4]);
-		account.username = account.username + L"#" + argv[4];
-		account.emailOriginal = account.email;
-		account.email = argv[5];
-		account.accountName = account.email;
-		account.displayName = argv[6];
-		account.syncOneMonth = true;
-		if (argc > 7)
-			account.syncOneMonth = !wcscmp(argv[7], L"1");
-		account.showReminders = true;
-		if (argc > 8)
-			account.showReminders = !wcscmp(argv[8], L"1");
-
-		try
+			profileName = argv[2];
+			if (Verify(argv[2], argv[3]) > 0)
+				return 1;
+		}
+		else if (argc > 1 && (!wcscmp(argv[1], L"/export") || !wcscmp(argv[1], L"/import")))
 		{
-			account.LOG_VERBOSE(L"Creating account");
-			// Create the account
-			account.Create();
-			account.LOG_VERBOSE(L"Created account");
+			if (argc < 5 || argc > 6)
+				Usage();
+
+			profileName = argv[2];
+			// Only a placeholder, as for update passwords
+			wstring passphrase;
+			if (argc > 5)
+			{
+				if (wcscmp(argv[5], L"-"))
+					throw exception("Passphrase must be given as -");
+				passphrase = ReadSecretLine();
+				if (passphrase.empty())
+					throw exception("Empty passphrase");
+			}
+
+			int failed = 0;
+			try
+			{
+				if (!wcscmp(argv[1], L"/export"))
+					ExportAccounts(argv[2], argv[3], argv[4], passphrase);
+				else
+					failed = ImportAccounts(argv[2], argv[3], argv[4], passphrase);
+			}
+			catch (...)
+			{
+				SecureZeroMemory(&passphrase[0], passphrase.size() * sizeof(wchar_t));
+				throw;
+			}
+			SecureZeroMemory(&passphrase[0], passphrase.size() * sizeof(wchar_t));
+			if (failed > 0)
+				return 1;
 		}
-		catch (...)
+		else
 		{
-			account.LOG_VERBOSE(L"Handling exception");
-			throw;
+			if (argc < 7 || argc > 9)
+				Usage();
+
+			profileName = argv[1];
+			AddShare(argc, argv, timeBudget, dryRun);
 		}
 	}
 	catch (const CustomException &e)
 	{
-		if (!strcmp(e.what(), "AdminServices") && e.status == 0x80040111)
+		if ((!strcmp(e.what(), "AdminServices") && e.status == 0x80040111) || 
+			(!strcmp(e.what(), "OpenAccountsKey") && e.status == ERROR_FILE_NOT_FOUND))
+		{
+			LOG(L"Profile does not exist: %ls\n", profileName);
+		}
+		else if (!strcmp(e.what(), "Deadline"))
 		{
-			LOG(L"Profile does not exist: %ls\n", account.profileName.c_str());
+			return EXIT_TIMEOUT;
 		}
 		else
 		{
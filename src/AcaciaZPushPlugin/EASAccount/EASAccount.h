@@ -16,12 +16,18 @@
 
 #define NOMINMAX 
 #include <atlbase.h>
+#include <atlfile.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <initguid.h>
@@ -30,11 +36,15 @@
 #include <MAPIX.h>
 #include <MAPIguid.h>
 #include <MAPIAux.h>
+#include <MAPIUtil.h>
 
 #include <crtdbg.h>
+#include <fcntl.h>
+#include <io.h>
 #include <comdef.h>
 #include <Shlobj.h>
 #include <strsafe.h>
+#include <bcrypt.h>
 
 using namespace std;
 
@@ -225,23 +235,34 @@ public:
 class CustomException : public exception
 {
 public:
+	// What kind of code status is
+	enum Kind
+	{
+		KIND_WIN32,
+		KIND_HRESULT,
+		KIND_NTSTATUS
+	};
+
 	const LONG status;
+	const Kind kind;
 	wstring message;
 
 	CustomException(LONG status, const char *ident, const wchar_t *message)
 		:
 		exception(ident),
-		status(status)
+		status(status),
+		kind(KIND_HRESULT)
 	{
 		wchar_t buffer[0x10000];
 		wnsprintf(buffer, sizeof(buffer), L"%.8X: %hs: %s", status, ident, message);
 		this->message = buffer;
 	}
 
-	CustomException(LONG status, const char *ident)
+	CustomException(LONG status, const char *ident, Kind kind = KIND_WIN32)
 		:
 		exception(ident),
-		status(status)
+		status(status),
+		kind(kind)
 	{
 		LPSTR messageBuffer = nullptr;
 		size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
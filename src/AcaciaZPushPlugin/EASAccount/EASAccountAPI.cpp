@@ -0,0 +1,210 @@
+#include "Account.h"
+#include "EASAccountAPI.h"
+
+static void ApiLogHandler(void *context, bool isVerbose, const wchar_t *message)
+{
+	const EASAccountCallbacks *callbacks = (const EASAccountCallbacks*)context;
+	if (callbacks && callbacks->log)
+		callbacks->log(callbacks->context, isVerbose ? 1 : 0, message);
+}
+
+/**
+ * Runs an API call, routing the log to the callbacks and translating exceptions into an HRESULT.
+ */
+template<class Func>
+static HRESULT RunApi(const EASAccountCallbacks *callbacks, Func func)
+{
+	ScopedLogHandler logHandler(ApiLogHandler, (void*)callbacks);
+
+	try
+	{
+		func();
+		return S_OK;
+	}
+	catch (const CustomException &e)
+	{
+		LOG(L"Exception: %s\n", e.message.c_str());
+		switch (e.kind)
+		{
+		case CustomException::KIND_HRESULT: return e.status;
+		case CustomException::KIND_NTSTATUS: return HRESULT_FROM_NT(e.status);
+		default: return HRESULT_FROM_WIN32(e.status);
+		}
+	}
+	catch (const exception &e)
+	{
+		LOG(L"Exception: %hs\n", e.what());
+		return E_FAIL;
+	}
+	catch (...)
+	{
+		return E_UNEXPECTED;
+	}
+}
+
+static void SetProgress(Account &account, const EASAccountCallbacks *callbacks)
+{
+	if (callbacks && callbacks->progress)
+	{
+		account.progress = [callbacks](const wchar_t *step, int current, int total)
+		{
+			callbacks->progress(callbacks->context, step, current, total);
+		};
+	}
+}
+
+static wstring ToAccountIdString(unsigned int accountId)
+{
+	wchar_t buffer[16];
+	swprintf_s(buffer, ARRAYSIZE(buffer), L"%.8X", accountId);
+	return buffer;
+}
+
+static int ReportAccountInfo(EASAccountInfoCallback callback, void *context, const AccountInfo &info)
+{
+	EASAccountInfo apiInfo;
+	apiInfo.accountId = info.accountId;
+	apiInfo.accountName = info.accountName.c_str();
+	apiInfo.displayName = info.displayName.c_str();
+	apiInfo.email = info.email.c_str();
+	apiInfo.shareFor = info.emailOriginal.c_str();
+	apiInfo.server = info.server.c_str();
+	apiInfo.username = info.username.c_str();
+	apiInfo.syncTimeFrame = info.syncTimeFrame;
+	apiInfo.showReminders = info.showReminders ? 1 : 0;
+	return callback(context, &apiInfo);
+}
+
+int EASACCOUNT_CALL EASAccount_GetApiVersion(void)
+{
+	return EASACCOUNT_API_VERSION;
+}
+
+long EASACCOUNT_CALL EASAccount_Create(const EASAccountParams *params, const EASAccountCallbacks *callbacks, unsigned int *accountId)
+{
+	if (!params || params->size != sizeof(EASAccountParams) || !params->profileName || !params->outlookVersion)
+		return E_INVALIDARG;
+
+	bool exists = false;
+	HRESULT hr = RunApi(callbacks, [&]()
+	{
+		#define PARAM(name) (params->name ? params->name : L"")
+
+		Account account;
+		SetProgress(account, callbacks);
+		account.profileName = params->profileName;
+		account.outlookVersion = params->outlookVersion;
+		if (params->sourceAccountId)
+		{
+			// Create a share of the source account
+			account.LoadFromAccountId(params->sourceAccountId);
+			account.username = account.username + L"#" + PARAM(username);
+			account.emailOriginal = account.email;
+		}
+		else
+		{
+			account.server = PARAM(server);
+			account.username = PARAM(username);
+			account.password = PARAM(password);
+		}
+		account.email = PARAM(email);
+		account.accountName = params->accountName ? params->accountName : account.email;
+		account.displayName = PARAM(displayName);
+		account.dataFolder = PARAM(dataFolder);
+		account.syncTimeFrame = params->syncTimeFrame;
+		account.showReminders = params->showReminders != 0;
+
+		#undef PARAM
+
+		// MAPI is only loaded if the account is not there yet
+		vector<wstring> changes;
+		DWORD existingAccountId = 0;
+		if (!account.Plan(changes, existingAccountId))
+		{
+			if (accountId)
+				*accountId = existingAccountId;
+			exists = true;
+			return;
+		}
+
+		account.LOG_VERBOSE(L"Creating account");
+		account.Create();
+		account.LOG_VERBOSE(L"Created account");
+		if (accountId)
+			*accountId = account.AccountId();
+	});
+	return hr == S_OK && exists ? S_FALSE : hr;
+}
+
+long EASACCOUNT_CALL EASAccount_Load(const wchar_t *profileName, const wchar_t *outlookVersion, unsigned int accountId,
+	EASAccountInfoCallback callback, const EASAccountCallbacks *callbacks)
+{
+	if (!profileName || !outlookVersion || !callback)
+		return E_INVALIDARG;
+
+	return RunApi(callbacks, [&]()
+	{
+		AccountInfo info = LoadAccountInfo(profileName, outlookVersion, accountId);
+		ReportAccountInfo(callback, callbacks ? callbacks->context : nullptr, info);
+	});
+}
+
+long EASACCOUNT_CALL EASAccount_Remove(const wchar_t *profileName, const wchar_t *outlookVersion, unsigned int accountId,
+	const EASAccountCallbacks *callbacks)
+{
+	if (!profileName || !outlookVersion)
+		return E_INVALIDARG;
+
+	return RunApi(callbacks, [&]()
+	{
+		Account account;
+		SetProgress(account, callbacks);
+		account.profileName = profileName;
+		account.outlookVersion = outlookVersion;
+		account.Remove(ToAccountIdString(accountId));
+	});
+}
+
+long EASACCOUNT_CALL EASAccount_Enumerate(const wchar_t *profileName, const wchar_t *outlookVersion,
+	EASAccountInfoCallback callback, const EASAccountCallbacks *callbacks)
+{
+	if (!profileName || !outlookVersion || !callback)
+		return E_INVALIDARG;
+
+	return RunApi(callbacks, [&]()
+	{
+		vector<AccountInfo> accounts = EnumerateAccounts(profileName, outlookVersion);
+		for (auto info = accounts.begin(); info != accounts.end(); ++info)
+		{
+			if (!ReportAccountInfo(callback, callbacks ? callbacks->context : nullptr, *info))
+				break;
+		}
+	});
+}
+
+long EASACCOUNT_CALL EASAccount_Verify(const wchar_t *profileName, const wchar_t *outlookVersion,
+	EASAccountHealthCallback callback, const EASAccountCallbacks *callbacks)
+{
+	if (!profileName || !outlookVersion || !callback)
+		return E_INVALIDARG;
+
+	return RunApi(callbacks, [&]()
+	{
+		vector<AccountHealth> accounts = VerifyAccounts(profileName, outlookVersion);
+		for (auto health = accounts.begin(); health != accounts.end(); ++health)
+		{
+			EASAccountHealth apiHealth;
+			apiHealth.accountId = health->accountId;
+			apiHealth.displayName = health->displayName.c_str();
+			apiHealth.accountLists = health->accountLists;
+			apiHealth.serviceExists = health->serviceExists ? 1 : 0;
+			apiHealth.ostPath = health->path.c_str();
+			apiHealth.ostExists = health->ostExists ? 1 : 0;
+			apiHealth.storeResult = health->storeResult;
+			apiHealth.intact = health->IsIntact() ? 1 : 0;
+			apiHealth.error = health->error.empty() ? nullptr : health->error.c_str();
+			if (!callback(callbacks ? callbacks->context : nullptr, &apiHealth))
+				break;
+		}
+	});
+}
@@ -0,0 +1,121 @@
+#ifndef __EASACCOUNT_API_H__
+#define __EASACCOUNT_API_H__
+
+/**
+ * Flat C interface to the account logic, exported by EASAccountLib-<arch>.dll. The names are
+ * exported undecorated through EASAccountLib.def, so they can be used through P/Invoke.
+ *
+ * All strings are UTF-16. Strings passed to callbacks are only valid for the duration of the
+ * callback. Functions return an HRESULT; Win32 errors are returned as HRESULT_FROM_WIN32 and
+ * NTSTATUS errors from the crypto functions as HRESULT_FROM_NT.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 3: syncTypes removed from EASAccountParams and EASAccountInfo, error added to EASAccountHealth
+#define EASACCOUNT_API_VERSION 3
+
+#define EASACCOUNT_CALL __stdcall
+
+typedef void (EASACCOUNT_CALL *EASAccountLogCallback)(void *context, int verbose, const wchar_t *message);
+typedef void (EASACCOUNT_CALL *EASAccountProgressCallback)(void *context, const wchar_t *step, int current, int total);
+
+/**
+ * Some steps of EASAccount_Create run on the system thread pool. Their log messages and progress
+ * may be reported from a pool thread, before the call returns. Progress is never reported 
+ * concurrently, but log messages of steps that run at the same time may be.
+ */
+typedef struct EASAccountCallbacks
+{
+	void *context;
+	// Optional, log messages are discarded if not set
+	EASAccountLogCallback log;
+	// Optional
+	EASAccountProgressCallback progress;
+} EASAccountCallbacks;
+
+typedef struct EASAccountParams
+{
+	// Must be set to sizeof(EASAccountParams); other sizes are rejected, as the layout changed in version 3
+	unsigned int size;
+	const wchar_t *profileName;
+	const wchar_t *outlookVersion;
+	// If set, the account is created as a share of this account, in hex. The server and
+	// credentials are taken from that account and username is the user whose store is shared.
+	const wchar_t *sourceAccountId;
+	const wchar_t *server;
+	const wchar_t *username;
+	// Not used for shares
+	const wchar_t *password;
+	const wchar_t *email;
+	// Defaults to the email address
+	const wchar_t *accountName;
+	const wchar_t *displayName;
+	// Optional, defaults to the Outlook folder in the local application data
+	const wchar_t *dataFolder;
+	// One of the SyncTimeFrame values of the plugin
+	unsigned int syncTimeFrame;
+	int showReminders;
+} EASAccountParams;
+
+typedef struct EASAccountInfo
+{
+	unsigned int accountId;
+	const wchar_t *accountName;
+	const wchar_t *displayName;
+	const wchar_t *email;
+	// The email address of the account this is a share of, or empty
+	const wchar_t *shareFor;
+	const wchar_t *server;
+	const wchar_t *username;
+	unsigned int syncTimeFrame;
+	int showReminders;
+} EASAccountInfo;
+
+// Return 0 to stop the enumeration
+typedef int (EASACCOUNT_CALL *EASAccountInfoCallback)(void *context, const EASAccountInfo *info);
+
+typedef struct EASAccountHealth
+{
+	unsigned int accountId;
+	const wchar_t *displayName;
+	// Mask of the account id lists the account is in: 1 mail, 2 address book, 4 store
+	unsigned int accountLists;
+	int serviceExists;
+	const wchar_t *ostPath;
+	int ostExists;
+	// Result of opening the store, S_FALSE if it was not attempted
+	long storeResult;
+	int intact;
+	// Since version 3. The error that stopped the checks of this account, null if they all ran
+	const wchar_t *error;
+} EASAccountHealth;
+
+// Return 0 to stop the enumeration
+typedef int (EASACCOUNT_CALL *EASAccountHealthCallback)(void *context, const EASAccountHealth *health);
+
+int EASACCOUNT_CALL EASAccount_GetApiVersion(void);
+
+// Returns S_FALSE, with the id of that account, if an account for the same server and user exists
+long EASACCOUNT_CALL EASAccount_Create(const EASAccountParams *params, const EASAccountCallbacks *callbacks, unsigned int *accountId);
+
+long EASACCOUNT_CALL EASAccount_Load(const wchar_t *profileName, const wchar_t *outlookVersion, unsigned int accountId,
+	EASAccountInfoCallback callback, const EASAccountCallbacks *callbacks);
+
+long EASACCOUNT_CALL EASAccount_Remove(const wchar_t *profileName, const wchar_t *outlookVersion, unsigned int accountId,
+	const EASAccountCallbacks *callbacks);
+
+long EASACCOUNT_CALL EASAccount_Enumerate(const wchar_t *profileName, const wchar_t *outlookVersion,
+	EASAccountInfoCallback callback, const EASAccountCallbacks *callbacks);
+
+// Since version 2. Read only; all checks are done before the first callback.
+long EASACCOUNT_CALL EASAccount_Verify(const wchar_t *profileName, const wchar_t *outlookVersion,
+	EASAccountHealthCallback callback, const EASAccountCallbacks *callbacks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EASACCOUNT_API_H__ */
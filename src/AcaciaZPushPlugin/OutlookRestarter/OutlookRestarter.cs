@@ -31,6 +31,14 @@ namespace OutlookRestarter
     class OutlookRestarter
     {
         private const int FINISH_WAIT_TIME = 15000;
+        /// <summary>
+        /// Extra time given to EASAccount after its deadline, as it is not ended while it registers an account
+        /// </summary>
+        private const int SHARE_GRACE_TIME = 15000;
+        /// <summary>
+        /// EASAccount exit code when the deadline or a step budget ran out
+        /// </summary>
+        private const int SHARE_EXIT_TIMEOUT = 4;
         private const int DELETE_RETRIES = 30;
         private const int DELETE_WAIT_TIME = 500;
 
@@ -113,9 +121,8 @@ namespace OutlookRestarter
         {
             string baseDir = Path.GetDirectoryName(Process.GetCurrentProcess().MainModule.FileName);
             string path = Path.Combine(baseDir, "EASAccount-" + arch + ".exe");
-            string[] args = rawArgs.Split(':');
-            for (int i = 0; i < args.Length; ++i)
-                args[i] = "\"" + args[i] + "\"";
+            List<string> args = new List<string>() { "/deadline", FINISH_WAIT_TIME.ToString() };
+            args.AddRange(Util.SplitEscaped(':', rawArgs).Select(arg => Util.QuoteCommandLine(arg)));
             string argsString = string.Join(" ", args);
 
             Logger.Instance.Debug(typeof(OutlookRestarter), "Request to open account: {0}: {1}", path, argsString);
@@ -126,21 +133,37 @@ namespace OutlookRestarter
             process.StartInfo.UseShellExecute = false;
             process.StartInfo.RedirectStandardOutput = true;
             process.StartInfo.RedirectStandardError = true;
+            string result = null;
             process.ErrorDataReceived += (s, e) => 
                 {
-                    if (!string.IsNullOrEmpty(e.Data.Trim()))
+                    if (e.Data == null)
+                        return;
+                    if (e.Data.StartsWith("RESULT:"))
+                        result = e.Data.Trim();
+                    else if (!string.IsNullOrEmpty(e.Data.Trim()))
                         Logger.Instance.Warning(typeof(OutlookRestarter), "EASAccount: {0}", e.Data.Trim());
                 };
             process.OutputDataReceived += (s, e) =>
                 {
-                    if (!string.IsNullOrEmpty(e.Data.Trim()))
+                    if (e.Data != null && !string.IsNullOrEmpty(e.Data.Trim()))
                         Logger.Instance.Debug(typeof(OutlookRestarter), "EASAccount: {0}", e.Data.Trim());
                 };
             process.Start();
             process.BeginOutputReadLine();
             process.BeginErrorReadLine();
-            process.WaitForExit(FINISH_WAIT_TIME);
-            Logger.Instance.Debug(typeof(OutlookRestarter), "Opened accounts: {0}", argsString);
+            if (!process.WaitForExit(FINISH_WAIT_TIME + SHARE_GRACE_TIME))
+            {
+                Logger.Instance.Warning(typeof(OutlookRestarter), "EASAccount did not finish in time: {0}", argsString);
+                return;
+            }
+            // Without a timeout, this waits for the redirected output to be read
+            process.WaitForExit();
+            if (process.ExitCode == SHARE_EXIT_TIMEOUT)
+                Logger.Instance.Warning(typeof(OutlookRestarter), "EASAccount timed out: {0}: {1}", argsString, result);
+            else if (process.ExitCode != 0)
+                Logger.Instance.Warning(typeof(OutlookRestarter), "EASAccount failed: {0}: {1}: {2}", argsString, process.ExitCode, result);
+            else
+                Logger.Instance.Info(typeof(OutlookRestarter), "Opened accounts: {0}: {1}", argsString, result);
         }
 
         private static void HandleCleanKoe(string path)